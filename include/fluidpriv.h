@@ -0,0 +1,159 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+/*
+ * FluidSynth does not export a way to call noteon of a preset. We need that
+ * to play presets of a sfont loaded into other synth (see sfcache.cpp).
+ *
+ * The following should be exactly as in sfloader/fluid_sfont.h of used FluidSynth,
+ * my source is for FluidSynth 2.0.5. Only leading fields we access are declared.
+ * Sample access (prefetch, SF3 decoded cache, streaming) and preset notify (on demand loading)
+ * are used only when FluidPrivCompatible().
+ */
+
+#include "fluidsynth.h"
+
+namespace FluidSynthVST {
+
+// fluid_sfont_t
+struct FluidSFontPriv {
+  void *data;
+  int id;
+  int refcount;
+  int bankofs;
+  fluid_sfont_free_t free;
+};
+
+struct FluidPresetPriv {
+  void *data;
+  fluid_sfont_t *sfont;
+  fluid_preset_free_t free;
+  fluid_preset_get_name_t get_name;
+  fluid_preset_get_banknum_t get_banknum;
+  fluid_preset_get_num_t get_num;
+  fluid_preset_noteon_t noteon;
+  int (*notify)(fluid_preset_t *preset, int reason, int chan); // FLUID_PRESET_SELECTED...
+};
+
+/*
+ * Default loader sfont (fluid_defsfont_t), data of fluid_sfont_t created by it.
+ * Sample data is loaded at once into sampledata (and sample24data for 24bit fonts),
+ * unless dynamic sample loading is on or the font is SF3 (compressed samples).
+ */
+struct FluidDefSFontPriv {
+  const void *fcbs;
+  char *filename;
+  unsigned int samplepos;
+  unsigned int samplesize;   // bytes
+  short *sampledata;
+  unsigned int sample24pos;
+  unsigned int sample24size; // bytes
+  char *sample24data;
+  fluid_sfont_t *sfont;
+  struct FluidListPriv *sample; // FluidSamplePriv, in "shdr" order
+};
+
+struct FluidListPriv {
+  void *data;
+  FluidListPriv *next;
+};
+
+// fluid_sample_t. After loading, start/end are inclusive indexes into data
+struct FluidSamplePriv {
+  char name[21];
+  unsigned int source_start;     // as in the file
+  unsigned int source_end;
+  unsigned int source_loopstart;
+  unsigned int source_loopend;
+  unsigned int start;
+  unsigned int end;
+  unsigned int loopstart;
+  unsigned int loopend;
+  unsigned int samplerate;
+  int origpitch;
+  int pitchadj;
+  int sampletype;
+  int auto_free;
+  short *data;
+  char *data24;
+  int amplitude_that_reaches_noise_floor_is_valid;
+  double amplitude_that_reaches_noise_floor;
+  unsigned int refcount;   // voices which play it
+  int preset_count;        // selected presets which use it, dynamic sample loading
+  int (*notify)(FluidSamplePriv *sample, int reason); // dynamic sample loading, unloads when not used
+};
+
+// The layout above is checked for this version only
+inline bool FluidPrivCompatible(){
+  int major, minor, micro;
+  fluid_version(&major, &minor, &micro);
+  return (major == 2) && (minor == 0);
+}
+
+inline const FluidDefSFontPriv *FluidDefSFont(fluid_sfont_t *sfont){
+  return static_cast<const FluidDefSFontPriv *>(fluid_sfont_get_data(sfont));
+}
+
+/*
+ * Points the font and all its samples to other sample data (streaming). For fonts loaded with
+ * dynamic sample loading, which have not loaded any samples. Samples are detached from dynamic
+ * loading, FluidSynth should not unload them when voices are done. NULL before the font is
+ * deleted, FluidSynth should not free the data.
+ */
+inline void FluidDefSFontSetSampleData(fluid_sfont_t *sfont, short *data, char *data24){
+  FluidDefSFontPriv *defsfont = static_cast<FluidDefSFontPriv *>(fluid_sfont_get_data(sfont));
+  defsfont->sampledata = data;
+  defsfont->sample24data = data24;
+  for(FluidListPriv *list = defsfont->sample; list; list = list->next){
+    FluidSamplePriv *sample = static_cast<FluidSamplePriv *>(list->data);
+    sample->data = data;
+    sample->data24 = data24;
+    sample->notify = NULL;
+  }
+}
+
+// Replaces the function which deletes the sfont, returns the original
+inline fluid_sfont_free_t FluidSFontSetFree(fluid_sfont_t *sfont, fluid_sfont_free_t free){
+  FluidSFontPriv *priv = reinterpret_cast<FluidSFontPriv *>(sfont);
+  fluid_sfont_free_t original = priv->free;
+  priv->free = free;
+  return original;
+}
+
+/*
+ * With "synth.dynamic-sample-loading", the default loader preset loads its samples when
+ * selected and unloads them when unselected (counted per sample). Used only when FluidPrivCompatible().
+ */
+inline int FluidPresetNotify(fluid_preset_t *preset, int reason, int chan){
+  FluidPresetPriv *priv = reinterpret_cast<FluidPresetPriv *>(preset);
+  return priv->notify ? priv->notify(preset, reason, chan) : FLUID_OK;
+}
+
+inline void FluidPresetSetNotify(fluid_preset_t *preset, int (*notify)(fluid_preset_t *, int, int)){
+  reinterpret_cast<FluidPresetPriv *>(preset)->notify = notify;
+}
+
+inline int FluidPresetNoteOn(fluid_preset_t *preset, fluid_synth_t *synth, int chan, int key, int vel){
+  FluidPresetPriv *priv = reinterpret_cast<FluidPresetPriv *>(preset);
+  return priv->noteon(preset, synth, chan, key, vel);
+}
+
+}
@@ -21,6 +21,7 @@
 #pragma once
 
 #include "pluginterfaces/base/fplatform.h"
+#include "base/source/fstreamer.h"
 #include "public.sdk/source/vst/vstaudioeffect.h"
 #include "public.sdk/source/vst/vsteditcontroller.h"
 #include "pluginterfaces/vst/ivstmidicontrollers.h"
@@ -28,11 +29,13 @@
 
 #include "fluidsynth.h"
 
-#ifdef WIN32
-#include <windows.h>
-#else /* Linux */
-#include <pthread.h>
-#endif /* Platform */
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sf2info.h"
+#include "telemetry.h"
 
 #define MAJOR_VERSION_STR "0"
 #define MAJOR_VERSION_INT 0
@@ -76,8 +79,141 @@ enum  FluidSynthVSTParams : Vst::ParamID {
     kRootPrgId,
     kChPrgId,
     kLastChPrgId = kChPrgId + 15,
+
+    // voice rendering threads, applied when the synth is (re)created
+    kCpuCoresId,
+    kThreadPrioId,
+
+    // quality and CPU use
+    kInterpId,
+    kPolyphonyId,
+    kReverbOnId,
+    kChorusOnId,
+    kStealingId,   // applied when the synth is (re)created
+    kAutoQualityId,
+
+    // additional SoundFonts (layers 1...) and the layer of each channel
+    kLayerFontId,
+    kLastLayerFontId = kLayerFontId + 2,
+    kChLayerId,
+    kLastChLayerId = kChLayerId + 15,
+
+    // read only, process blocks which have waited for streamed samples
+    kUnderrunsId,
+
+    // MIDI transform, 16 (channels) of each in this order
+    kChVelocityId,
+    kChTransposeId = kChVelocityId + 16,
+    kChKeyLowId = kChTransposeId + 16,
+    kChKeyHighId = kChKeyLowId + 16,
+    kChOutputId = kChKeyHighId + 16,
+    kChEventsId = kChOutputId + 16,
+    kLastChEventsId = kChEventsId + 15,
+};
+
+static const int32 kMaxCpuCores = 16;
+static const int32 kMaxThreadPrio = 99;
+static const int32 kDefaultThreadPrio = 60; // as FluidSynth audio.realtime-prio, process waits for voice threads
+static const int32 kMaxUnderruns = 9999; // shown, counted further
+
+/*
+ * Quality settings, applied to each synth. In auto mode the Processor lowers
+ * effective settings (tier) when block time approaches the deadline.
+ */
+enum InterpMode { kInterpNone, kInterpLinear, kInterp4th, kInterp7th, kInterpCount };
+enum StealingMode { kStealDefault, kStealOldest, kStealQuietest, kStealCount };
+static const int32 kPolyphonyCount = 6; // 32 ... 1024
+
+struct QualitySettings {
+  int32 interp;    // InterpMode
+  int32 polyphony; // index, 32 << polyphony voices
+  int32 stealing;  // StealingMode
+  bool  reverb;
+  bool  chorus;
+  bool  autoTier;
+
+  QualitySettings();
+  static int32 voices(int32 polyphony) { return 32 << polyphony; }
+  // Versioned block in the plug-in state, as SynthState
+  static const int32 kStreamVersion = 1;
+  static const int32 kStreamSize = 6 * 4; // version 1 part
+  void write(IBStreamer& streamer) const;
+  bool read(IBStreamer& streamer); // false when there is no (usable) block, the settings are not changed then
+};
+
+
+/*
+ * Several SoundFonts in one synth. Layer 0 is the main font (kRootPrgId), other layers
+ * are loaded with bank offset layer * kLayerBankOffset. Each channel plays presets of
+ * its layer, channels of layer 0 behave as before (the whole synth stack is searched).
+ */
+static const int32 kMaxLayers = 4;
+static const int32 kLayerBankOffset = 1000;
+
+struct LayerSettings {
+  std::string files[kMaxLayers]; // UTF-8, empty when not used. [0] is not used, that is the main font
+  int32 channels[16];
+
+  LayerSettings();
+  // Versioned block in the plug-in state, the size depends on file names
+  static const int32 kStreamVersion = 1;
+  void write(IBStreamer& streamer) const;
+  bool read(IBStreamer& streamer);
+};
+
+
+/*
+ * Per channel MIDI transform, applied before the synth: velocity curve, range of played
+ * (incoming) keys, transpose, output channel and events filter. Program changes are not
+ * transformed, they are synth channel parameters. Settings are compiled into tables when
+ * changed, so process only looks up. Defaults change nothing.
+ */
+enum VelocityCurve { kVelLinear, kVelSoft, kVelHard, kVelFixed, kVelCurveCount };
+enum ChannelEvents { kEventsAll, kEventsNotes, kEventsControllers, kEventsNone, kEventsCount };
+static const int32 kMaxTranspose = 48;
+static const int32 kFixedVelocity = 100;
+
+struct ChannelTransform {
+  int32 velocity;  // VelocityCurve
+  int32 transpose; // semitones
+  int32 keyLow;    // played keys, inclusive
+  int32 keyHigh;
+  int32 channel;   // output
+  int32 events;    // ChannelEvents
+};
+
+struct MidiTransform {
+  ChannelTransform channels[16];
+
+  MidiTransform();
+  // Versioned block in the plug-in state
+  static const int32 kStreamVersion = 1;
+  static const int32 kStreamSize = 16 * 6; // version 1 part
+  void write(IBStreamer& streamer) const;
+  bool read(IBStreamer& streamer); // false when there is no transform in the stream, the settings are not changed then
 };
 
+struct MidiTransformTables {
+  int16 key[16][128];      // output key, -1 when the note is not played
+  uint8 velocity[16][128]; // 0 (note off) stays 0
+  uint8 channel[16];
+  bool  controllers[16];   // CC, AT and PB are played
+
+  void compile(const MidiTransform& transform, int32 ch);
+  void compile(const MidiTransform& transform);
+};
+
+
+// Channel program list with fixed "Prog N" names, generated on request
+class ChannelProgramList : public Vst::ProgramList {
+  public:
+    ChannelProgramList(const Vst::String128 name, Vst::ProgramListID listId, Vst::UnitID unitId);
+
+    tresult getProgramName(int32 programIndex, Vst::String128 name) SMTG_OVERRIDE;
+    tresult getProgramInfo(int32 programIndex, Vst::CString attributeId, Vst::String128 value) SMTG_OVERRIDE;
+    tresult setProgramName(int32 programIndex, const Vst::String128 name) SMTG_OVERRIDE;
+    Vst::Parameter* getParameter() SMTG_OVERRIDE;
+};
 
 class Controller : public Vst::EditControllerEx1, public Vst::IMidiMapping {
   public:
@@ -85,6 +221,15 @@ class Controller : public Vst::EditControllerEx1, public Vst::IMidiMapping {
     tresult PLUGIN_API setComponentState(IBStream* state) SMTG_OVERRIDE;
     tresult PLUGIN_API setParamNormalized (Vst::ParamID tag, Vst::ParamValue value) SMTG_OVERRIDE;
 
+    // CC parameters are not registered
+    int32   PLUGIN_API getParameterCount () SMTG_OVERRIDE;
+    tresult PLUGIN_API getParameterInfo (int32 paramIndex, Vst::ParameterInfo& info) SMTG_OVERRIDE;
+    tresult PLUGIN_API getParamStringByValue (Vst::ParamID tag, Vst::ParamValue valueNormalized, Vst::String128 string) SMTG_OVERRIDE;
+    tresult PLUGIN_API getParamValueByString (Vst::ParamID tag, Vst::TChar* string, Vst::ParamValue& valueNormalized) SMTG_OVERRIDE;
+    Vst::ParamValue PLUGIN_API normalizedParamToPlain (Vst::ParamID tag, Vst::ParamValue valueNormalized) SMTG_OVERRIDE;
+    Vst::ParamValue PLUGIN_API plainParamToNormalized (Vst::ParamID tag, Vst::ParamValue plainValue) SMTG_OVERRIDE;
+    Vst::ParamValue PLUGIN_API getParamNormalized (Vst::ParamID tag) SMTG_OVERRIDE;
+
     tresult PLUGIN_API getMidiControllerAssignment (int32 busIndex, int16 channel, Vst::CtrlNumber midiControllerNumber, Vst::ParamID& id/*out*/) SMTG_OVERRIDE;
 
     tresult PLUGIN_API getUnitByBus (Vst::MediaType type, Vst::BusDirection dir, int32 busIndex, int32 channel, Vst::UnitID& unitId /*out*/) SMTG_OVERRIDE;
@@ -105,6 +250,55 @@ class Controller : public Vst::EditControllerEx1, public Vst::IMidiMapping {
 
   private:
     float mCurrentProgram;
+    float mCurrentLayers[kMaxLayers - 1]; // layer font parameters, also set by the processor
+    int32 mNumParameters; // registered
+    Vst::ParamValue mCCValues[16][Vst::kCountCtrlNumber];
+};
+
+// MIDI channel state which we transfer from one synth to another.
+// FluidSynth has no getters for pressure and held notes, so Processor tracks them
+// in the same structure while playing.
+struct ChannelState {
+  int   bank;
+  int   program;
+  int   pitchBend;
+  int   pitchWheelSens;
+  int   pressure;
+  uint8 cc[128];
+  uint8 noteVelocity[128]; // 0 when the note is not held
+};
+
+// Synth wide reverb and chorus settings
+struct EffectsState {
+  double reverbRoomSize;
+  double reverbDamping;
+  double reverbWidth;
+  double reverbLevel;
+  int    chorusNr;
+  double chorusLevel;
+  double chorusSpeed;
+  double chorusDepth;
+  int    chorusType;
+};
+
+struct SynthState {
+  ChannelState channels[16];
+  EffectsState effects;
+
+  SynthState();
+  void captureFrom(fluid_synth_t* synth); // everything except pressure and notes
+  void applyTo(fluid_synth_t* synth) const;
+  // only what differs from applied (the synth has it), returns channel bits with changed program
+  uint32 applyChangesTo(fluid_synth_t* synth, const SynthState& applied) const;
+
+  // Versioned snapshot in the plug-in state, without held notes
+  static const int32 kStreamVersion = 1;
+  static const int32 kStreamSize = 16 * (4 * 2 + 1 + 128) + 2 * 4 + 7 * 8; // version 1 part
+  void write(IBStreamer& streamer) const;
+  bool read(IBStreamer& streamer);
+  void noteOn(int ch, int key, int vel);
+  void noteOff(int ch, int key);
+  void allNotesOff(int ch);
 };
 
 class Processor : public Vst::AudioEffect {
@@ -115,6 +309,8 @@ class Processor : public Vst::AudioEffect {
     tresult PLUGIN_API setBusArrangements(Vst::SpeakerArrangement* inputs, int32 numIns,
 					  Vst::SpeakerArrangement* outputs, int32 numOuts) SMTG_OVERRIDE;
 
+    tresult PLUGIN_API activateBus (Vst::MediaType type, Vst::BusDirection dir, int32 index, TBool state) SMTG_OVERRIDE;
+    uint32  PLUGIN_API getTailSamples () SMTG_OVERRIDE;
     tresult PLUGIN_API canProcessSampleSize (int32 symbolicSampleSize) SMTG_OVERRIDE;
     tresult PLUGIN_API setupProcessing (Vst::ProcessSetup& setup) SMTG_OVERRIDE;
     tresult PLUGIN_API setActive (TBool state) SMTG_OVERRIDE;
@@ -130,44 +326,232 @@ class Processor : public Vst::AudioEffect {
       return (Vst::IAudioProcessor*)new Processor ();
     }
 
-    void    syncedLoadSoundFont(); // public for thread function
+    // for loader workers
+    fluid_synth_t* loadSoundFont(const char *fileName, Sf2Info& info, uint32& capture);
+    void    completeLoading(fluid_synth_t* synth, const Sf2Info& info, uint32 generation, uint32 capture);
+    bool    isCurrentRequest(uint32 generation) { return generation == mRequestedGeneration; }
+    // the latest requested font is in use, for the process thread
+    bool    isSoundFontLoaded() { return mLoadedGeneration == mRequestedGeneration; }
+    // font requests from process, resolved by loader workers
+    bool    hasProcessRequest() const;
+    void    takeProcessRequest();
+
+    // background prefetch, for loader workers
+    bool    hasPrefetch() const { return !mPrefetchQueue.empty(); }
+    void    prefetchPresets();
+    int64   lockedBytes() const { return mLockedBytes; }
+
+    static const int32 kCrossfadeMs = 20;
+    static const int32 kMaxRetiredSynths = 4;
 
   protected:
     bool mBypass = false;
 
     fluid_settings_t* mSynthSettings;
+    std::mutex        mSettingsMutex; // synths are created by loader workers (several at once) and the UI thread
     fluid_synth_t* mSynth;
-    int32          mSoundFontID; // -1 when failed to load
+
+    // Hot swap: new font is loaded into standby synth while the current one is still playing,
+    // then the channel state is transferred and the old synth is faded out.
+    bool           mHotSwap;
+    std::atomic<fluid_synth_t*> mStandbySynth; // loaded by a loader worker
+    std::atomic<uint32> mStandbyGeneration;
+    fluid_synth_t* mFadeSynth;      // previous synth, fading out
+    int32          mFadeLength;     // in samples
+    int32          mFadePos;
+    float         *mFadeBufs[2];
+    int32          mFadeBufsSize;
+    std::atomic<fluid_synth_t*> mRetiredSynths[kMaxRetiredSynths]; // to be deleted outside process
+    SynthState     mSynthState;     // pressure and held notes, the rest is captured on swap
 
     using StringVector = std::vector<String>;
-    StringVector mSoundFontFiles; // in UTF-8
+    StringVector mSoundFontFiles; // in UTF-8, sorted
     String       mSoundFontFile;
     bool         mChangeSoundFont;
-
-    float  *mAudioBufs[2];
+    std::mutex   mFontMutex; // the above, between UI thread and loader workers, process does not use them
+    // Process does not lock nor allocate: it leaves the index in mSoundFontFiles of the new font
+    // (-1 when none) or asks to rebuild with the current one, loader workers resolve the name.
+    // Both are cleared when the request is queued, so offline process can wait for it.
+    std::atomic<int32>  mProcessFontIdx;
+    std::atomic<uint32> mProcessRebuilds;
+    std::atomic<uint32> mTakenRebuilds;
+    uint32       mSoundFontIndexGeneration; // merged into mSoundFontFiles
+
+    // Output busses. In multi output mode there is a stereo bus per MIDI channel and
+    // for reverb and chorus, in addition to the main one.
+    enum { kMainBus = 0, kFirstChannelBus = 1, kReverbBus = 17, kChorusBus, kMaxOutputBusses };
+    bool    mMultiOut;
+    uint32  mActiveOutputBusses; // bit mask
+
+    float  *mAudioBufs[kMaxOutputBusses*2]; // for 64bit processing
     int32   mAudioBufsSize;
 
-
-    void  writeAudio(Vst::ProcessData& data, int32 start_sample, int32 end_samle);
-    int32 nextOffset(Vst::ProcessData& data, int32 curSample);
-    void  playParChanges(Vst::ProcessData& data, int32 curSample, int32 endSample);
-    void  playEvents(Vst::ProcessData& data, int32 curSample, int32 endSample);
-
-    void  scanSoundFonts();
-    bool  checkSoundFont(bool synced);
+    std::atomic<int32> mCpuCores;   // synth.cpu-cores
+    std::atomic<int32> mThreadPrio; // audio.realtime-prio, for voice rendering threads
+
+
+    // Parameter points and events of one block, merged and time ordered.
+    // Preallocated outside process, buildSchedule never grows it.
+    struct ScheduledItem {
+      int32           sampleOffset;
+      int32           order;  // arrival order, parameter points go before events
+      Vst::ParamID    id;     // parameter point
+      Vst::ParamValue value;
+      bool            isEvent;
+      Vst::Event      event;
+    };
+    using Schedule = std::vector<ScheduledItem>;
+    Schedule mSchedule;
+    int32    mScheduleDropped; // intermediate points which have not fit, since start
+
+    // CC, AT and PB values as the synth (mCtrlSynth) has them, -1 when not known. Points
+    // which do not change the value are not played. Dense points are thinned to
+    // mCtrlGranularity samples in buildSchedule, the last point of a queue is kept.
+    fluid_synth_t* mCtrlSynth;
+    int16    mCtrlValues[16][Vst::kCountCtrlNumber];
+    int32    mCtrlGranularity;
+
+    Telemetry mTelemetry; // the process thread should not print
+
+    // Bypass, crossfade between the synth and the input. Voices are stopped when faded out.
+    static const int32 kBypassRampMs = 10;
+    int32   mBypassPos;    // 0 is the synth only, mBypassLength is the input only
+    int32   mBypassLength; // samples
+
+    // Silence detection, no voices and effects have decayed
+    static constexpr float kSilenceLevel = 1e-6f; // -120dB
+    static constexpr double kReverbMinDecaySec = 0.7;
+    static constexpr double kReverbMaxDecaySec = 12.5;
+    bool    mIdle;
+    std::atomic<double> mStandbyRelease; // longest release in the standby synth font, sec.
+    std::atomic<double> mFontRelease;    // the same for current synth
+
+    // Channel state in the plug-in state. getState asks process to capture it, restored
+    // state is applied by process in one go once the font is loaded.
+    static const int32 kStateCaptureWaitMs = 100;
+    enum { kCaptureIdle, kCaptureRequested, kCaptureBusy };
+    std::atomic<bool>        mProcessing;
+    std::atomic<int32>       mCaptureState;
+    SynthState               mSnapshot;     // the last captured or restored
+    std::atomic<SynthState*> mPendingState; // from setState, taken by process
+    std::atomic<SynthState*> mAppliedState; // applied by process, to be deleted outside
+
+    // Channel state of a loaded synth. The worker asks process to capture the current one
+    // and replays it on the standby synth, process applies only changes since the capture
+    // when adopting it (full state when that was another capture or none).
+    std::mutex               mLoadCaptureMutex; // between workers
+    std::atomic<int32>       mLoadCaptureState;
+    SynthState               mLoadSnapshot;     // the last capture, with pressure and held notes
+    uint32                   mLoadCapture;      // its number, 0 when there is none
+    std::atomic<uint32>      mStandbyCapture;   // replayed on the standby synth, 0 when none
+
+    // Quality tiers, 0 is what the user has set
+    static const int32 kMaxTier = 3;
+    static constexpr double kTierUpLoad = 0.7;    // of the block duration, smoothed
+    static constexpr double kTierDownLoad = 0.35;
+    static constexpr double kTierUpHoldSec = 0.5; // before the next change
+    static constexpr double kTierDownHoldSec = 2.;
+    // Owned by process, setState hands restored settings over as mPendingTransform.
+    // Loader workers read stealing from mStealing, set when the rebuild is requested.
+    QualitySettings   mQuality;
+    std::atomic<QualitySettings*> mPendingQuality; // from setState, taken by process
+    std::atomic<QualitySettings*> mAppliedQuality; // copied by process, to be deleted outside
+    std::atomic<int32> mStealing;      // StealingMode for newSynth
+    std::atomic<bool> mQualityChanged; // apply in process
+    int32   mTier;
+    double  mLoadAvg;
+    int32   mTierHold; // samples
+
+    // Offline processing: the best quality, all cores, process waits for the font
+    static const int32 kOfflineLoadWaitMs = 30000;
+    bool    mOffline;
+    uint32  mWaitedGeneration;
+
+    // Layers, files are set from process and setState and read by loader workers
+    std::mutex          mLayersMutex;
+    LayerSettings       mLayers;                // channels are not used, see mChannelLayers
+    // from process, list index of each layer font (0 is None, -1 when not changed), see mProcessFontIdx
+    std::atomic<int32>  mProcessLayerFonts[kMaxLayers - 1];
+    std::atomic<int32>  mChannelLayers[16];
+
+    // Sample prefetch, see sfcache.h. Process queues program changes, loader workers
+    // touch samples of presets in use and lock them within "lock" option budget.
+    static const size_t kPrefetchBudget = 64 << 20; // bytes touched per preset
+    SpscRing<int32, 64> mPrefetchQueue;             // bank * 128 + program, layer banks with the offset
+    std::atomic<int32>  mChannelPresets[16];        // the same, per channel
+    std::mutex          mPrefetchMutex;             // the rest, loader workers only
+    std::string         mPrefetchPaths[kMaxLayers]; // the latest loaded fonts, by layer
+    using LockedPreset = std::pair<int32, int64>;  // preset, bytes
+    std::vector<LockedPreset> mLockedPresets;
+    std::atomic<int64>  mLockedBytes;
+
+    // MIDI transform, owned by process. Settings are changed by parameters (compiled at once)
+    // and setState (taken and compiled by the next process, as mPendingState). Held notes
+    // remember where they are played.
+    MidiTransform       mTransform;
+    std::atomic<MidiTransform*> mPendingTransform; // from setState, taken by process
+    std::atomic<MidiTransform*> mAppliedTransform; // copied by process, to be deleted outside
+    MidiTransformTables mTransformTables;
+    int16               mPlayedNotes[16][128]; // output channel * 128 + key, -1 when not played
+    bool                mMidiThru;
+
+    // Streaming underruns, see sfcache.h. Reported by output parameter changes.
+    bool    mStreaming;
+    uint32  mUnderruns;     // blocks with major page faults
+    uint32  mUnderrunsSent;
+
+    bool  renderAudio(float **outputs, int32 numOutputs, int32 numSamples);
+    bool  writeAudio(Vst::ProcessData& data, int32 start_sample, int32 end_samle);
+    void  writeCrossfade(float **outputs, int32 numOutputs, int32 numSamples);
+    bool  isOutputBusUsed(Vst::ProcessData& data, int32 bus);
+    bool  writeBypass(Vst::ProcessData& data);
+    bool  rampBypass(Vst::ProcessData& data);
+    int32 buildSchedule(Vst::ProcessData& data, int32& nextEvent, int32& fromOffset);
+    void  playParChange(Vst::ProcessData& data, Vst::ParamID id, Vst::ParamValue value);
+    bool  ctrlChanged(int32 ch, int32 ctrlNumber, int32 value);
+    void  resetCtrlValues(int32 ch = -1);
+    void  playEvent(Vst::ProcessData& data, Vst::Event& e);
+    void  setTransform(Vst::ParamID id, Vst::ParamValue value);
+
+    bool  scanSoundFonts();
+    void  refreshSoundFonts();
+    bool  checkSoundFont();
+    void  serveStateRequests();
+    void  serveLoadCapture();
+    uint32 captureLoadState(SynthState& state);
+    bool  captureSnapshot();
+    void  requestSoundFont(bool isDefault = false);
+    fluid_synth_t* newSynth();
+    int32 loadFonts(fluid_synth_t* synth, const char *soundFontFile, Sf2Info* info);
+    void  selectProgram(fluid_synth_t* synth, int32 ch, int32 program);
+    void  selectLayers(fluid_synth_t* synth, const SynthState& state);
+    bool  setLayerFont(int32 layer, const String& fileName);
+    bool  rebuildSynth();
+    void  applyQuality(fluid_synth_t* synth);
+    int32 cpuCores() const;
+    void  waitSoundFont();
+    void  waitPresets();
+    void  queuePrefetch(int32 ch, int32 bank, int32 program);
+    void  prefetchFonts(const std::string (&paths)[kMaxLayers]);
+    const char* prefetchPath(int32 preset, int32& bank, int32& program) const;
+    void  prefetchPreset(int32 preset);
+    void  countUnderruns(Vst::ProcessData& data, long long faults);
+    void  unlockPresets(bool unusedOnly);
+    void  updateAutoTier(int32 blockUs, int32 numSamples);
+    void  requestRebuild();
+    bool  setThreading(int32 cpuCores, int32 threadPrio);
+    void  adoptStandbySynth(bool fade);
+    bool  retireSynth(fluid_synth_t* synth);
+    void  deleteRetiredSynths();
     int   getCurrentSoundFontIdx();
     float getCurrentSoundFontNormalized();
+    float getLayerFontNormalized(int32 layer);
     void  sendCurrentProgram();
     void  sendProgramList();
 
   private:
-#ifdef WIN32
-    HANDLE     mLoadingThread;
-#else /* Linux */
-    pthread_t  mLoadingThread;
-#endif /* platform */
-    String       mLoadedFile;
-    bool         mLoadingComplete;
+    std::atomic<uint32> mRequestedGeneration; // the latest font request
+    uint32              mLoadedGeneration;    // the font in mSynth
 };
 
 
@@ -0,0 +1,66 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "pluginterfaces/base/fplatform.h"
+
+namespace FluidSynthVST {
+using namespace Steinberg;
+
+class Processor;
+
+/*
+ * Module wide SoundFont loading workers.
+ *
+ * Requests are "latest wins" per Processor: a new request replaces not yet started one,
+ * a started but superseded one is discarded by the Processor when it is complete.
+ * Requests for the default font are started only after kDefaultFontDelayMs, so the real
+ * font from setState (which hosts call after setupProcessing) normally replaces them
+ * before they start. There are kLoaderThreads workers, so a running stale load does not
+ * block the next one.
+ */
+static const int32 kLoaderThreads = 2;
+static const int32 kDefaultFontDelayMs = 200;
+
+// Start the workers, from Processor::initialize (not from process, they are created once)
+void StartSoundFontLoader();
+
+void RequestSoundFont(Processor *processor, const char *fileName, uint32 generation, bool isDefault);
+
+// Remove queued requests of the processor and wait till running are finished
+void CancelSoundFontRequests(Processor *processor);
+
+/*
+ * Background preset prefetch. Registered processors are asked for queued work
+ * (Processor::prefetchPresets) when there is no font to load. Font requests from
+ * process (Processor::takeProcessRequest) are taken the same way, before the queue. Process wakes workers
+ * without locking, in case the wake up is missed they look every kPrefetchPollMs.
+ * CancelSoundFontRequests also unregisters. On demand sample loading (see sfcache.h)
+ * is served the same way.
+ */
+static const int32 kPrefetchPollMs = 50;
+
+void RegisterPrefetch(Processor *processor);
+void WakeSoundFontLoader(); // real time safe
+
+// Stop the workers, on module unload
+void StopSoundFontLoader();
+
+}
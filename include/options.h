@@ -0,0 +1,55 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace FluidSynthVST {
+
+/*
+ * Module wide options, read once from "fluidsynthvst.ini" in the plug-in directory.
+ * The file is optional, each line is "name = value", '#' starts a comment.
+ * Boolean values are 0/1, "library" can be repeated.
+ */
+struct Options {
+  bool hotSwap;    // hotswap: load new font into standby synth while current is playing (1)
+  bool mmapFiles;  // mmap: read SoundFont files through memory mapping (no RSS saving, see stream), fallback to normal reading (1)
+  bool multiOut;   // multiout: stereo output bus per MIDI channel, reverb and chorus (0)
+  bool telemetry;  // telemetry: log block time statistics and histogram (0)
+  std::vector<std::string> libraryDirs; // library: additional SoundFont directory
+  int  rescanSec;  // rescan: SoundFont directories rescan period in seconds, 0 - only not watched (0)
+  int  lockMb;     // lock: per instance budget to lock samples of used presets in memory, MB (0)
+  bool onDemand;   // ondemand: load samples of a preset only when some channel selects it (0)
+  int  evictSec;   // evict: with ondemand, unload samples of presets not selected for that long, seconds (60)
+  bool sf3Cache;   // sf3cache: keep decoded copy of SF3 fonts on disk, to load them faster next time (1)
+  std::string cacheDir; // cachedir: directory for decoded fonts, empty - user cache directory ()
+  bool stream;     // stream: play SF2 samples from the file mapping, only sample heads are kept in memory, the rest can be read from disk in process (0)
+  int  streamHeadMs; // streamhead: with stream, locked head of each sample, ms (250)
+  bool midiThru;   // midithru: event output which gets all incoming events as they are (0)
+  int  ccGranularity; // ccgranularity: min. distance between CC, AT and PB points of one parameter in a block, samples (0)
+
+  Options();
+  void set(const char *name, const char *value);
+};
+
+const Options& GetOptions();
+
+}
@@ -0,0 +1,53 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <utility>
+#include <vector>
+
+namespace FluidSynthVST {
+
+// Sample data used by a preset, [start, end) in sample points, sorted and merged
+struct Sf2PresetSamples {
+  int bank;
+  int program;
+  std::vector<std::pair<unsigned, unsigned>> ranges;
+};
+
+/*
+ * Information FluidSynth does not provide, read directly from SoundFont (SF2/SF3)
+ * "pdta" chunk. Samples are not read.
+ */
+struct Sf2Info {
+  int    version;       // major "ifil" version, 2 for SF2 and 3 for SF3 (compressed samples)
+  int    numPresets;
+  double maxReleaseSec; // the longest volume envelope release, instrument + preset offset
+  std::vector<Sf2PresetSamples> presets; // sorted by bank and program
+
+  Sf2Info() : version(0), numPresets(0), maxReleaseSec(0.) {}
+};
+
+// Returns false when the file can not be read or is not a SoundFont
+bool ReadSf2Info(const char *fileName, Sf2Info& info);
+
+// NULL when there is no such preset
+const Sf2PresetSamples* FindPresetSamples(const Sf2Info& info, int bank, int program);
+
+}
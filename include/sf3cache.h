@@ -0,0 +1,55 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <string>
+
+#include "fluidsynth.h"
+
+namespace FluidSynthVST {
+
+/*
+ * On disk cache of decoded SF3 (Ogg Vorbis compressed) SoundFonts.
+ *
+ * Decoding is the most expensive part of loading SF3. Once loaded, the font is written
+ * as plain SF2 with the same presets and instruments and decoded samples, so the next
+ * load is just a (memory mapped) read. The cache file name is derived from the file
+ * name, size, modification time and FluidSynth version, so a changed file or
+ * FluidSynth gets a new one (old ones are deleted).
+ *
+ * Cache directory is "cachedir" option, by default the user cache directory.
+ */
+
+// Cache file path for the SF3, false when caching is off (then path is empty)
+bool DecodedSoundFontPath(const char *fileName, std::string& path);
+
+// Write decoded copy of the SF3 loaded into sfont by the default loader
+bool WriteDecodedSoundFont(const char *fileName, const std::string& path, fluid_sfont_t *sfont);
+
+// Path for the copy of the file samples streamed instead of the file, "<font name>-<hash>.smpl" in
+// the cache directory, keyed as decoded copies. The copy is written into tmpPath (unique) and
+// published by CommitStreamCopy, so the file under path is never truncated while it is mapped.
+// False when there is no cache directory.
+bool StreamCopyPath(const char *fileName, std::string& path, std::string& tmpPath);
+
+// Rename the written copy to path and delete copies of other versions of the file
+bool CommitStreamCopy(const char *fileName, const std::string& tmpPath, const std::string& path);
+
+}
@@ -0,0 +1,83 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include "fluidsynth.h"
+
+namespace FluidSynthVST {
+
+/*
+ * Module wide SoundFont cache.
+ *
+ * SoundFonts are loaded once per module (by file path and modification time) and
+ * all synths of all instances get light proxies to the same presets and samples.
+ * The data is released when the last synth has unloaded it.
+ */
+
+// New loader for the synth, the synth takes the ownership (fluid_synth_add_sfloader).
+// NULL with not compatible FluidSynth, the synth uses the default loader then.
+fluid_sfloader_t* NewSharedSoundFontLoader();
+
+// Number of currently cached SoundFonts, for statistic
+int SharedSoundFontCount();
+
+/*
+ * Sample pages of a preset in the cached font (by path). Prefetch touches them, so
+ * the first note does not take page faults on the audio thread, and optionally locks
+ * them in memory. Not more than budget bytes are touched. Returns the size of preset
+ * samples, 0 when the font is not cached or samples are not in one block (SF3).
+ * Locks are counted per preset, UnlockSharedPreset releases one.
+ */
+size_t PrefetchSharedPreset(const char *path, int bank, int program, size_t budget, bool lock);
+void   UnlockSharedPreset(const char *path, int bank, int program);
+
+/*
+ * On demand sample loading ("ondemand" option). Fonts are loaded without samples.
+ * Proxy presets count channels of all synths which have selected them (FluidSynth notifies
+ * that on program change, from the audio thread) and wake loader workers. Workers load samples
+ * of selected presets and unload samples of presets not selected for "evict" seconds (at least
+ * the longest release of the font). Till the samples are loaded, preset notes are not played.
+ */
+static const int kEvictCheckMs = 1000;
+static const int kEvictGraceMs = 20; // for noteon which has seen the preset loaded
+
+bool HasSharedPresetWork();
+void ServeSharedPresets();   // loader workers
+bool SharedPresetsLoading(); // some selected preset is not yet loaded
+
+/*
+ * Streaming ("stream" option). SF2 fonts are loaded without samples (as for on demand loading),
+ * then samples are pointed into a memory mapped file: the decoded SF3 copy, or a cached copy
+ * of the sample chunks (the user file can change under us, see StreamCopyPath). The head ("streamhead" ms)
+ * of each sample is locked in memory, the rest is paged in by the system. The page cache is the stream buffer:
+ * loader workers read ahead samples of selected presets (and repeat that every kStreamReadAheadMs,
+ * in case the system has dropped them), while the system reads ahead of sequential voice reads.
+ * The mapping is closed when FluidSynth deletes the font, so no voice plays it.
+ *
+ * So streaming saves memory, but does not keep disk reads out of the audio thread: a page which
+ * is not in memory blocks it till it is read. ThreadMajorFaults counts such faults of the calling
+ * thread (0 where that is not known), process only reports them as underruns.
+ */
+static const int kStreamReadAheadMs = 10000;
+static const size_t kStreamCopyBufSize = 1 << 20;
+
+long long ThreadMajorFaults();
+
+}
@@ -0,0 +1,66 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "pluginterfaces/base/fplatform.h"
+
+#include "sf2info.h"
+
+namespace FluidSynthVST {
+using namespace Steinberg;
+
+/*
+ * Module wide index of available SoundFonts.
+ *
+ * Directories are the plug-in one followed by "library" directories from options.
+ * Fonts are identified by file name only (that is saved in the state), when the same
+ * name exists in several directories the first one is used.
+ *
+ * The index is scanned once and then refreshed incrementally: on Linux from inotify
+ * events, directories which can not be watched (and all on Windows) are scanned again
+ * when the last scan is older than kRescanSec (or "rescan" option).
+ * Refresh is done by the calls below, there is no thread.
+ */
+static const int32 kRescanSec = 30;
+
+// Sorted font file names, returns the index generation (changed when the list is changed)
+uint32 GetSoundFontNames(std::vector<std::string>& names);
+
+// Current index generation, refreshes the index
+uint32 GetSoundFontIndexGeneration();
+
+// Full path for the file name, the plug-in directory is assumed for unknown names
+void GetSoundFontPath(const char *name, char *path, int32 size);
+
+/*
+ * Size, modification time and information from the file itself. The information is
+ * cached till the file is changed. Returns false when the file can not be read.
+ */
+struct SoundFontFileInfo {
+  long long size;
+  long long mtime;
+  Sf2Info   sf2;
+};
+bool GetSoundFontInfo(const char *name, SoundFontFileInfo& info);
+
+}
@@ -0,0 +1,165 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include "pluginterfaces/base/fplatform.h"
+
+namespace FluidSynthVST {
+using namespace Steinberg;
+
+/*
+ * Realtime telemetry.
+ *
+ * The process thread never prints or locks. It pushes fixed size records into
+ * a wait-free single producer / single consumer ring, one per Processor. The module
+ * wide telemetry thread drains all rings into logs (stdout) and per instance
+ * block time histograms.
+ */
+enum TelemetryType : uint16 {
+  kTelBlock,          // process block: duration, arg = numSamples, scheduled items, active voices, dropped items
+  kTelProbe,          // scoped probe: id, duration
+  kTelUnknownEvent,   // arg[0] = event type
+  kTelUnknownParam,   // arg[0] = parameter ID
+  kTelUnknownCtrl,    // arg[0] = channel, arg[1] = controller number
+  kTelQualityTier,    // arg[0] = new auto quality tier
+  kTelUnderrun,       // arg[0] = major page faults in the block, arg[1] = underruns so far
+};
+
+enum TelemetryBlockFlags : uint16 {
+  kTelFontLoaded = 1, // the requested font is in use
+  kTelFading     = 2, // hot swap crossfade in progress
+  kTelBypass     = 4,
+};
+
+struct TelemetryRecord {
+  uint16 type;
+  uint16 id;        // probe ID or block flags
+  int32  duration;  // uSec
+  int32  arg[4];
+};
+
+// Wait-free ring, push from one thread and pop from one (other) thread only
+template<class T, uint32 kSize>
+class SpscRing {
+  static_assert((kSize & (kSize - 1)) == 0, "SpscRing size should be power of 2");
+  public:
+    SpscRing() : mHead(0), mTail(0) {}
+
+    bool push(const T& item){
+      uint32 head = mHead.load(std::memory_order_relaxed);
+      if(head - mTail.load(std::memory_order_acquire) >= kSize)
+	return false; // full
+      mItems[head & (kSize - 1)] = item;
+      mHead.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    bool empty() const {
+      return mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_acquire);
+    }
+
+    bool pop(T& item){
+      uint32 tail = mTail.load(std::memory_order_relaxed);
+      if(tail == mHead.load(std::memory_order_acquire))
+	return false; // empty
+      item = mItems[tail & (kSize - 1)];
+      mTail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+  private:
+    T mItems[kSize];
+    std::atomic<uint32> mHead; // written by producer
+    std::atomic<uint32> mTail; // written by consumer
+};
+
+class Telemetry {
+  public:
+    static const uint32 kRingSize = 1024;     // ~2 sec. of blocks at 64 samples / 44.1kHz
+    static const int32  kHistogramBins = 24;  // log2 uSec, the last one is "more"
+
+    Telemetry();
+    ~Telemetry();
+
+    // process thread
+    void push(const TelemetryRecord& record){
+      if(!mRing.push(record))
+	mOverflows.fetch_add(1, std::memory_order_relaxed);
+    }
+    bool isTimed() const { return mTimed; }
+
+    // telemetry thread
+    void drain();
+
+  private:
+    void printStatistics();
+
+    SpscRing<TelemetryRecord, kRingSize> mRing;
+    std::atomic<uint32> mOverflows;
+    bool   mTimed;      // time blocks and probes (option)
+    uint64 mBlocks;
+    int64  mBlockUs;    // since the last statistics print
+    int32  mMaxBlockUs;
+    int32  mMaxVoices;
+    int32  mLastDropped;
+    uint64 mHistogram[kHistogramBins]; // block time, printed when the instance is deleted
+    std::chrono::steady_clock::time_point mLastPrint;
+};
+
+/*
+ * Scoped time measurement, pushes a record on exit. Nothing is measured (and
+ * so the clock is not read) when timing is off.
+ */
+class TelemetryProbe {
+  public:
+    TelemetryProbe(Telemetry& telemetry, uint16 type, uint16 id = 0) : mTelemetry(telemetry) {
+      mRecord.type = type;
+      mRecord.id = id;
+      mRecord.arg[0] = mRecord.arg[1] = mRecord.arg[2] = mRecord.arg[3] = 0;
+      if(mTelemetry.isTimed())
+	mStart = std::chrono::steady_clock::now();
+    }
+    ~TelemetryProbe(){
+      if(mTelemetry.isTimed()){
+	mRecord.duration = (int32)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mStart).count();
+	mTelemetry.push(mRecord);
+      }
+    }
+    TelemetryRecord& record() { return mRecord; }
+
+  private:
+    Telemetry& mTelemetry;
+    TelemetryRecord mRecord;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+// Log from the process thread
+inline void TelemetryLog(Telemetry& telemetry, uint16 type, int32 arg0, int32 arg1 = 0){
+  TelemetryRecord record = { type, 0, 0, { arg0, arg1, 0, 0 } };
+  telemetry.push(record);
+}
+
+// Stop the telemetry thread, on module unload
+void StopTelemetry();
+
+}
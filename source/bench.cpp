@@ -0,0 +1,493 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Headless benchmark host (Linux).
+ *
+ * Instantiates the Processor without any host and audio device, plays
+ * a MIDI file or generated MIDI as fast as possible and prints JSON
+ * report to stdout. SoundFonts are looked up in the directory of the
+ * executable, as the plug-in does it for its own directory.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "public.sdk/source/common/memorystream.h"
+#include "public.sdk/source/vst/hosting/eventlist.h"
+#include "public.sdk/source/vst/hosting/parameterchanges.h"
+
+#include "../include/fluidsynthvst.h"
+
+using namespace Steinberg;
+using namespace FluidSynthVST;
+
+// normally defined by the SDK module entry, GetPath uses it
+void *moduleHandle = NULL;
+
+bool InitModule();
+bool DeinitModule();
+
+// one short MIDI message at sample position
+struct BenchMidi {
+  int64 sample;
+  uint8 status;
+  uint8 data1;
+  uint8 data2;
+};
+
+static double NowUs(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * Standard MIDI file, format 0 or 1. All tracks are merged, tempo changes
+ * are taken into account. Meta and SysEx events are skipped.
+ */
+static uint32 ReadVarLen(const uint8 *&p, const uint8 *end){
+  uint32 value = 0;
+  while(p < end){
+    uint8 c = *p++;
+    value = (value << 7) | (c & 0x7f);
+    if(!(c & 0x80))
+      break;
+  }
+  return value;
+}
+
+static uint32 ReadBE(const uint8 *p, int32 size){
+  uint32 value = 0;
+  for(int32 i = 0; i < size; ++i)
+    value = (value << 8) | p[i];
+  return value;
+}
+
+struct SmfEvent {
+  uint64 tick;
+  uint32 order;  // keep file order for the same tick
+  uint32 tempo;  // microseconds per quarter, 0 for MIDI events
+  uint8  status;
+  uint8  data1;
+  uint8  data2;
+};
+
+static bool LoadMidiFile(const char *fileName, double sampleRate, std::vector<BenchMidi>& out){
+  FILE *f = fopen(fileName, "rb");
+  if(!f)
+    return false;
+  std::vector<uint8> file;
+  uint8 buf[4096];
+  size_t n;
+  while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    file.insert(file.end(), buf, buf + n);
+  fclose(f);
+
+  const uint8 *p = file.data(), *end = file.data() + file.size();
+  if((file.size() < 14) || memcmp(p, "MThd", 4))
+    return false;
+  uint32 headerSize = ReadBE(p + 4, 4);
+  uint32 numTracks = ReadBE(p + 10, 2);
+  int32 division = (int16)ReadBE(p + 12, 2);
+  p += 8 + headerSize;
+
+  std::vector<SmfEvent> events;
+  for(uint32 track = 0; (track < numTracks) && (p + 8 <= end); ++track){
+    uint32 trackSize = ReadBE(p + 4, 4);
+    bool isTrack = !memcmp(p, "MTrk", 4);
+    p += 8;
+    const uint8 *tp = p, *tend = std::min(p + trackSize, end);
+    p = tend;
+    if(!isTrack)
+      continue;
+    uint64 tick = 0;
+    uint8 running = 0;
+    while(tp < tend){
+      tick += ReadVarLen(tp, tend);
+      if(tp >= tend)
+	break;
+      uint8 status = *tp;
+      if(status == 0xff){ // meta
+	if(tp + 2 > tend)
+	  break;
+	uint8 type = tp[1];
+	tp += 2;
+	uint32 len = ReadVarLen(tp, tend);
+	if((type == 0x51) && (len == 3) && (tp + 3 <= tend))
+	  events.push_back({tick, (uint32)events.size(), ReadBE(tp, 3), 0, 0, 0});
+	tp += len;
+	continue;
+      }
+      if((status == 0xf0) || (status == 0xf7)){ // SysEx
+	++tp;
+	tp += ReadVarLen(tp, tend);
+	continue;
+      }
+      if(status & 0x80){
+	running = status;
+	++tp;
+      } else
+	status = running;
+      if(!(status & 0x80))
+	break; // broken file
+      int32 dataSize = ((status & 0xe0) == 0xc0) ? 1 : 2;
+      if(tp + dataSize > tend)
+	break;
+      events.push_back({tick, (uint32)events.size(), 0, status, tp[0], (uint8)(dataSize > 1 ? tp[1] : 0)});
+      tp += dataSize;
+    }
+  }
+  std::sort(events.begin(), events.end(), [](const SmfEvent& a, const SmfEvent& b){
+      return (a.tick < b.tick) || ((a.tick == b.tick) && (a.order < b.order));
+    });
+
+  // ticks to samples
+  double secondsPerTick;
+  if(division > 0)
+    secondsPerTick = 0.5 / division; // 120 BPM
+  else
+    secondsPerTick = 1. / ((-(division >> 8)) * (division & 0xff)); // SMPTE
+  uint64 lastTick = 0;
+  double seconds = 0.;
+  for(auto const& e : events){
+    seconds += (e.tick - lastTick) * secondsPerTick;
+    lastTick = e.tick;
+    if(e.tempo){
+      if(division > 0)
+	secondsPerTick = e.tempo / 1e6 / division;
+    } else
+      out.push_back({(int64)(seconds * sampleRate), e.status, e.data1, e.data2});
+  }
+  return true;
+}
+
+/*
+ * Dense synthetic MIDI: notes on all channels, CC and pitch bend automation,
+ * program changes. The same seed produce the same sequence.
+ */
+static void GenerateMidi(double sampleRate, double seconds, int32 notesPerSecond, uint32 seed, std::vector<BenchMidi>& out){
+  std::mt19937 rnd(seed);
+  int64 length = seconds * sampleRate;
+  int32 numNotes = notesPerSecond * seconds;
+  for(int32 i = 0; i < numNotes; ++i){
+    uint8 ch = rnd() % 16;
+    uint8 key = (ch == 9) ? 35 + rnd() % 47 : 36 + rnd() % 60;
+    int64 on = rnd() % length;
+    int64 off = std::min(length, on + (int64)((0.05 + (rnd() % 1000) / 1000.) * sampleRate));
+    out.push_back({on, (uint8)(0x90 | ch), key, (uint8)(1 + rnd() % 127)});
+    out.push_back({off, (uint8)(0x80 | ch), key, 64});
+  }
+  // every 10ms: mod wheel, expression and pitch bend on each channel
+  int64 step = sampleRate / 100;
+  for(int64 pos = 0; pos < length; pos += step){
+    for(uint8 ch = 0; ch < 16; ++ch){
+      int32 phase = (pos / step + ch * 7) % 128;
+      out.push_back({pos, (uint8)(0xb0 | ch), 1, (uint8)phase});
+      out.push_back({pos, (uint8)(0xb0 | ch), 11, (uint8)(127 - phase)});
+      int32 bend = phase * 128;
+      out.push_back({pos, (uint8)(0xe0 | ch), (uint8)(bend & 0x7f), (uint8)(bend >> 7)});
+    }
+  }
+  // every 2 seconds a program change on some channel
+  for(int64 pos = 0; pos < length; pos += 2 * sampleRate){
+    uint8 ch = rnd() % 16;
+    out.push_back({pos, (uint8)(0xc0 | ch), (uint8)(rnd() % 128), 0});
+  }
+  std::stable_sort(out.begin(), out.end(), [](const BenchMidi& a, const BenchMidi& b){
+      return a.sample < b.sample;
+    });
+}
+
+// MIDI message to VST event or parameter change, as a host would do with our mapping
+static void FeedMidi(const BenchMidi& m, int32 sampleOffset, Vst::EventList& events, Vst::ParameterChanges& changes){
+  uint8 ch = m.status & 0x0f;
+  Vst::ParamID id;
+  Vst::ParamValue value;
+  switch(m.status & 0xf0){
+    case 0x90:
+    case 0x80: {
+      Vst::Event e = {};
+      e.sampleOffset = sampleOffset;
+      if(((m.status & 0xf0) == 0x90) && m.data2){
+	e.type = Vst::Event::kNoteOnEvent;
+	e.noteOn.channel = ch;
+	e.noteOn.pitch = m.data1;
+	e.noteOn.velocity = m.data2 / 127.f;
+	e.noteOn.noteId = -1;
+      } else {
+	e.type = Vst::Event::kNoteOffEvent;
+	e.noteOff.channel = ch;
+	e.noteOff.pitch = m.data1;
+	e.noteOff.velocity = m.data2 / 127.f;
+	e.noteOff.noteId = -1;
+      }
+      events.addEvent(e);
+      return;
+    }
+    case 0xb0:
+      id = 1024 + 1024*ch + m.data1;
+      value = m.data2 / 127.;
+      break;
+    case 0xd0:
+      id = 1024 + 1024*ch + Vst::kAfterTouch;
+      value = m.data1 / 127.;
+      break;
+    case 0xe0:
+      id = 1024 + 1024*ch + Vst::kPitchBend;
+      value = (m.data1 | (m.data2 << 7)) / 16383.;
+      break;
+    case 0xc0:
+      id = kChPrgId + ch;
+      value = m.data1 / 127.;
+      break;
+    default:
+      return;
+  }
+  int32 index;
+  Vst::IParamValueQueue *queue = changes.addParameterData(id, index);
+  if(queue)
+    queue->addPoint(sampleOffset, value, index);
+}
+
+// Current resident set size
+static long ResidentKb(){
+  long pages = 0, resident = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if(f){
+    if(fscanf(f, "%ld %ld", &pages, &resident) != 2)
+      resident = 0;
+    fclose(f);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double Percentile(std::vector<double>& sorted, double p){
+  if(sorted.empty())
+    return 0.;
+  size_t idx = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+  return sorted[idx];
+}
+
+static void Usage(const char *name){
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -f font     SoundFont file name in the executable directory (default font otherwise)\n"
+	  "  -m file     play standard MIDI file instead of generated MIDI\n"
+	  "  -r rate     sample rate (44100)\n"
+	  "  -b size     block size (512)\n"
+	  "  -s seconds  length of generated MIDI (30)\n"
+	  "  -n notes    generated notes per second (200)\n"
+	  "  -c cores    voice threads (1)\n"
+	  "  -C count    Controller instances to measure startup (16)\n"
+	  "  -d          64bit processing\n",
+	  name);
+}
+
+int main(int argc, char **argv){
+  const char *fontName = "";
+  const char *midiFile = NULL;
+  double sampleRate = 44100.;
+  int32 blockSize = 512;
+  double seconds = 30.;
+  int32 notesPerSecond = 200;
+  int32 cpuCores = 1;
+  int32 numControllers = 16;
+  bool doublePrecision = false;
+  int opt;
+  while((opt = getopt(argc, argv, "f:m:r:b:s:n:c:C:dh")) != -1){
+    switch(opt){
+      case 'f': fontName = optarg; break;
+      case 'm': midiFile = optarg; break;
+      case 'r': sampleRate = atof(optarg); break;
+      case 'b': blockSize = atoi(optarg); break;
+      case 's': seconds = atof(optarg); break;
+      case 'n': notesPerSecond = atoi(optarg); break;
+      case 'c': cpuCores = atoi(optarg); break;
+      case 'C': numControllers = atoi(optarg); break;
+      case 'd': doublePrecision = true; break;
+      default:
+	Usage(argv[0]);
+	return 1;
+    }
+  }
+  if((sampleRate <= 0) || (blockSize <= 0) || (seconds <= 0)){
+    Usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<BenchMidi> midi;
+  if(midiFile){
+    if(!LoadMidiFile(midiFile, sampleRate, midi)){
+      fprintf(stderr, "Could not read '%s'\n", midiFile);
+      return 1;
+    }
+  } else
+    GenerateMidi(sampleRate, seconds, notesPerSecond, 1, midi);
+  int64 length = (midi.empty() ? 0 : midi.back().sample) + 2 * sampleRate; // release tails
+
+  InitModule();
+
+  // Controller startup time and memory, per instance
+  std::vector<Controller *> controllers;
+  long controllersKb = ResidentKb();
+  double controllersStart = NowUs();
+  for(int32 i = 0; i < numControllers; ++i){
+    Controller *controller = new Controller;
+    controller->initialize(NULL);
+    controllers.push_back(controller);
+  }
+  double controllerUs = numControllers > 0 ? (NowUs() - controllersStart) / numControllers : 0.;
+  double controllerKb = numControllers > 0 ? (double)(ResidentKb() - controllersKb) / numControllers : 0.;
+  for(auto controller : controllers){
+    controller->terminate();
+    controller->release();
+  }
+
+  Processor *processor = new Processor;
+  processor->initialize(NULL);
+
+  Vst::ProcessSetup setup = {};
+  setup.processMode = Vst::kRealtime;
+  setup.symbolicSampleSize = doublePrecision ? Vst::kSample64 : Vst::kSample32;
+  setup.maxSamplesPerBlock = blockSize;
+  setup.sampleRate = sampleRate;
+  processor->setupProcessing(setup);
+  processor->setActive(true);
+
+  // state as a host restores it: bypass, font, threading
+  MemoryStream *state = new MemoryStream;
+  {
+    IBStreamer streamer(state, kLittleEndian);
+    streamer.writeInt32(0);
+    streamer.writeStr8(fontName);
+    streamer.writeInt32(cpuCores);
+    streamer.writeInt32(0);
+  }
+  state->seek(0, IBStream::kIBSeekSet, NULL);
+  double loadStart = NowUs();
+  processor->setState(state);
+  state->release();
+
+  std::vector<float> bufs32(2 * blockSize);
+  std::vector<double> bufs64(2 * blockSize);
+  float *channels32[2] = { bufs32.data(), bufs32.data() + blockSize };
+  double *channels64[2] = { bufs64.data(), bufs64.data() + blockSize };
+  Vst::AudioBusBuffers output = {};
+  output.numChannels = 2;
+  if(doublePrecision)
+    output.channelBuffers64 = channels64;
+  else
+    output.channelBuffers32 = channels32;
+  Vst::EventList events(1024);
+  Vst::ParameterChanges changes(16 * Vst::kCountCtrlNumber + 32);
+
+  Vst::ProcessData data = {};
+  data.processMode = setup.processMode;
+  data.symbolicSampleSize = setup.symbolicSampleSize;
+  data.numSamples = blockSize;
+  data.numInputs = 0; // the input is not used
+  data.numOutputs = 1;
+  data.outputs = &output;
+  data.inputParameterChanges = &changes;
+  data.inputEvents = &events;
+
+  processor->setProcessing(true);
+
+  // process empty blocks till the font is in use, as a host with stopped transport
+  while(!processor->isSoundFontLoaded() && (NowUs() - loadStart < 60e6)){
+    processor->process(data);
+    usleep(1000);
+  }
+  double loadMs = (NowUs() - loadStart) / 1000.;
+  bool loaded = processor->isSoundFontLoaded();
+
+  std::vector<double> blockUs;
+  blockUs.reserve(length / blockSize + 1);
+  size_t next = 0;
+  double processUs = 0.;
+  double peak = 0.;
+  for(int64 pos = 0; pos < length; pos += blockSize){
+    events.clear();
+    changes.clearQueue();
+    while((next < midi.size()) && (midi[next].sample < pos + blockSize)){
+      FeedMidi(midi[next], (int32)std::max<int64>(0, midi[next].sample - pos), events, changes);
+      ++next;
+    }
+    double start = NowUs();
+    processor->process(data);
+    double us = NowUs() - start;
+    blockUs.push_back(us);
+    processUs += us;
+    for(int32 i = 0; i < 2 * blockSize; ++i)
+      peak = std::max(peak, (double)fabs(doublePrecision ? bufs64[i] : bufs32[i]));
+  }
+  int64 lockedBytes = processor->lockedBytes();
+  processor->setProcessing(false);
+  processor->setActive(false);
+  processor->terminate();
+  processor->release();
+  DeinitModule();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  double audioSeconds = (double)blockUs.size() * blockSize / sampleRate;
+  double blockBudgetUs = blockSize * 1e6 / sampleRate;
+  std::sort(blockUs.begin(), blockUs.end());
+  size_t overruns = blockUs.end() - std::upper_bound(blockUs.begin(), blockUs.end(), blockBudgetUs);
+
+  printf("{\n");
+  printf("  \"font\": \"%s\",\n", fontName);
+  printf("  \"midi\": \"%s\",\n", midiFile ? midiFile : "generated");
+  printf("  \"sample_rate\": %.0f,\n", sampleRate);
+  printf("  \"block_size\": %d,\n", blockSize);
+  printf("  \"sample_size\": %d,\n", doublePrecision ? 64 : 32);
+  printf("  \"voice_threads\": %d,\n", cpuCores);
+  printf("  \"midi_messages\": %zu,\n", midi.size());
+  printf("  \"font_loaded\": %s,\n", loaded ? "true" : "false");
+  printf("  \"load_ms\": %.3f,\n", loadMs);
+  printf("  \"blocks\": %zu,\n", blockUs.size());
+  printf("  \"audio_seconds\": %.3f,\n", audioSeconds);
+  printf("  \"process_seconds\": %.6f,\n", processUs / 1e6);
+  printf("  \"realtime_factor\": %.3f,\n", processUs > 0 ? audioSeconds * 1e6 / processUs : 0.);
+  printf("  \"block_budget_us\": %.3f,\n", blockBudgetUs);
+  printf("  \"block_overruns\": %zu,\n", overruns);
+  printf("  \"block_us\": { \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f },\n",
+	 Percentile(blockUs, 0.), Percentile(blockUs, 0.5), Percentile(blockUs, 0.9),
+	 Percentile(blockUs, 0.99), Percentile(blockUs, 0.999), blockUs.empty() ? 0. : blockUs.back());
+  printf("  \"output_peak\": %.6f,\n", peak);
+  printf("  \"locked_kb\": %lld,\n", (long long)(lockedBytes / 1024));
+  printf("  \"controller_init_us\": %.3f,\n", controllerUs);
+  printf("  \"controller_kb\": %.1f,\n", controllerKb);
+  printf("  \"peak_rss_kb\": %ld\n", usage.ru_maxrss);
+  printf("}\n");
+  return loaded ? 0 : 2;
+}
@@ -19,6 +19,14 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define FLUIDSYNTHVST_SSE2
+#include <emmintrin.h>
+#endif
 
 #include "public.sdk/source/main/pluginfactory.h"
 #include "base/source/fstreamer.h"
@@ -27,6 +35,12 @@
 #include "pluginterfaces/base/ustring.h"
 
 #include "../include/fluidsynthvst.h"
+#include "../include/sfcache.h"
+#include "../include/sf2info.h"
+#include "../include/sfindex.h"
+#include "../include/options.h"
+#include "../include/loader.h"
+#include "../include/telemetry.h"
 
 #include "pluginterfaces/vst/ivstevents.h"
 #include "pluginterfaces/vst/ivstmidicontrollers.h"
@@ -38,33 +52,23 @@ namespace FluidSynthVST {
 using namespace Steinberg;
 
 
-#ifdef WIN32
-#else /* Linux */
-#include <time.h>
 
-class PerfMeter {
-  private:
-    struct timespec start_ts;
-    struct timespec end_ts;
-    unsigned long long md;
-    char *pfx;
-
-  public:
-    PerfMeter(const char *prefix = "Perf", unsigned long long min_diff = 1) : md(min_diff){
-      clock_gettime(CLOCK_REALTIME, &start_ts);
-      pfx = strdup(prefix);
-    }
-    ~PerfMeter(){
-      clock_gettime(CLOCK_REALTIME, &end_ts);
-      unsigned long long td = (end_ts.tv_sec - start_ts.tv_sec)*1000000 + (end_ts.tv_nsec - start_ts.tv_nsec)/1000;
-      if(td >= md)
-	printf("%s: %llu uSec\n", pfx, td);
-    }
-};
-#endif /* platform */
+// float -> double conversion for 64bit processing
+static void FloatToDouble(const float *src, double *dst, int32 n){
+  int32 i = 0;
+#ifdef FLUIDSYNTHVST_SSE2
+  for(; i + 4 <= n; i += 4){
+    __m128 f = _mm_loadu_ps(src + i);
+    _mm_storeu_pd(dst + i, _mm_cvtps_pd(f));
+    _mm_storeu_pd(dst + i + 2, _mm_cvtps_pd(_mm_movehl_ps(f, f)));
+  }
+#endif
+  for(; i < n; ++i)
+    dst[i] = src[i];
+}
 
 // CC Names
-static const char *szCCName[Vst::kCountCtrlNumber] = {
+static constexpr const char *szCCName[Vst::kCountCtrlNumber] = {
     // MSB
     "Bank (MSB)", //= 0x00
     "Modulation (MSB)", //= 0x01,
@@ -164,55 +168,660 @@ static const char *szCCName[Vst::kCountCtrlNumber] = {
     "PB", //= 0x81
 };
 
+/*
+ * CC, AfterTouch and PitchBend parameters of one channel, in szCCName order.
+ * There are 16 x ~100 of them, so they are not registered as Parameter objects
+ * in the Controller, their info and strings are generated on request.
+ */
+struct CCParamTable {
+  int16 ctrlNumber[Vst::kCountCtrlNumber];
+  int32 count;
+};
+
+static constexpr CCParamTable MakeCCParamTable(){
+  CCParamTable table = {};
+  for(int32 i = 0; i < Vst::kCountCtrlNumber; ++i){
+    if(szCCName[i][0])
+      table.ctrlNumber[table.count++] = i;
+  }
+  return table;
+}
+
+static constexpr CCParamTable kCCParams = MakeCCParamTable();
+
+static inline Vst::ParamID CCParamId(int32 ch, int32 ctrlNumber){
+  return 1024 + 1024*ch + ctrlNumber;
+}
+
+static bool IsCCParam(Vst::ParamID id, int32& ch, int32& ctrlNumber){
+  if(id < 1024)
+    return false;
+  ch = id / 1024 - 1;
+  ctrlNumber = id % 1024;
+  return (ch < 16) && (ctrlNumber < Vst::kCountCtrlNumber) && szCCName[ctrlNumber][0];
+}
+
+/*
+ * Controllers which just set a value, so a point which does not change it can be dropped.
+ * Data entry and (N)RPN selection act on each message, mode messages are commands.
+ */
+static bool IsValueCtrl(int32 ctrlNumber){
+  switch(ctrlNumber){
+    case Vst::kCtrlDataEntryMSB:
+    case Vst::kCtrlDataEntryLSB:
+    case Vst::kCtrlDataIncrement:
+    case Vst::kCtrlDataDecrement:
+    case Vst::kCtrlNRPNSelectLSB:
+    case Vst::kCtrlNRPNSelectMSB:
+    case Vst::kCtrlRPNSelectLSB:
+    case Vst::kCtrlRPNSelectMSB:
+      return false;
+  }
+  return (ctrlNumber < Vst::kCtrlAllSoundsOff) || (ctrlNumber == Vst::kAfterTouch) || (ctrlNumber == Vst::kPitchBend);
+}
+
+// 14bit for PitchBend, 7bit for the rest
+static int32 CtrlValue(int32 ctrlNumber, Vst::ParamValue value){
+  return (ctrlNumber == Vst::kPitchBend) ? (int32)(value*16383. + 0.5) : (int32)(value*127. + 0.5);
+}
+
+
+// SynthState
+SynthState::SynthState(){
+  for(auto& chState : channels){
+    chState.bank = 0;
+    chState.program = 0;
+    chState.pitchBend = 8192;
+    chState.pitchWheelSens = 2;
+    chState.pressure = 0;
+    memset(chState.cc, 0, sizeof(chState.cc));
+    memset(chState.noteVelocity, 0, sizeof(chState.noteVelocity));
+  }
+  // FluidSynth defaults
+  effects.reverbRoomSize = 0.2;
+  effects.reverbDamping = 0.0;
+  effects.reverbWidth = 0.5;
+  effects.reverbLevel = 0.9;
+  effects.chorusNr = 3;
+  effects.chorusLevel = 2.0;
+  effects.chorusSpeed = 0.3;
+  effects.chorusDepth = 8.0;
+  effects.chorusType = FLUID_CHORUS_MOD_SINE;
+}
+
+void SynthState::captureFrom(fluid_synth_t* synth){
+  for(int ch = 0; ch < 16; ++ch){
+    ChannelState& chState = channels[ch];
+    int sfontId, value;
+    fluid_synth_get_program(synth, ch, &sfontId, &chState.bank, &chState.program);
+    fluid_synth_get_pitch_bend(synth, ch, &chState.pitchBend);
+    fluid_synth_get_pitch_wheel_sens(synth, ch, &chState.pitchWheelSens);
+    for(int ctrl = 0; ctrl < 128; ++ctrl){
+      if(fluid_synth_get_cc(synth, ch, ctrl, &value) == FLUID_OK)
+	chState.cc[ctrl] = value;
+    }
+  }
+  effects.reverbRoomSize = fluid_synth_get_reverb_roomsize(synth);
+  effects.reverbDamping = fluid_synth_get_reverb_damp(synth);
+  effects.reverbWidth = fluid_synth_get_reverb_width(synth);
+  effects.reverbLevel = fluid_synth_get_reverb_level(synth);
+  effects.chorusNr = fluid_synth_get_chorus_nr(synth);
+  effects.chorusLevel = fluid_synth_get_chorus_level(synth);
+  effects.chorusSpeed = fluid_synth_get_chorus_speed(synth);
+  effects.chorusDepth = fluid_synth_get_chorus_depth(synth);
+  effects.chorusType = fluid_synth_get_chorus_type(synth);
+}
+
+// bank select, (N)RPN and channel mode messages are not replayed as controllers
+static bool IsStateController(int ctrl){
+  return (ctrl != Vst::kCtrlBankSelectMSB) && (ctrl != Vst::kCtrlBankSelectLSB) &&
+    (ctrl != Vst::kCtrlDataEntryMSB) && (ctrl != Vst::kCtrlDataEntryLSB) &&
+    ((ctrl < Vst::kCtrlDataIncrement) || (ctrl > Vst::kCtrlRPNSelectMSB)) &&
+    (ctrl < Vst::kCtrlAllSoundsOff);
+}
+
+void SynthState::applyTo(fluid_synth_t* synth) const {
+  for(int ch = 0; ch < 16; ++ch){
+    const ChannelState& chState = channels[ch];
+    fluid_synth_bank_select(synth, ch, chState.bank);
+    fluid_synth_program_change(synth, ch, chState.program);
+    fluid_synth_pitch_wheel_sens(synth, ch, chState.pitchWheelSens);
+    for(int ctrl = 0; ctrl < 128; ++ctrl){
+      if(IsStateController(ctrl))
+	fluid_synth_cc(synth, ch, ctrl, chState.cc[ctrl]);
+    }
+    fluid_synth_pitch_bend(synth, ch, chState.pitchBend);
+    fluid_synth_channel_pressure(synth, ch, chState.pressure);
+    for(int key = 0; key < 128; ++key){
+      if(chState.noteVelocity[key])
+	fluid_synth_noteon(synth, ch, key, chState.noteVelocity[key]);
+    }
+  }
+  fluid_synth_set_reverb(synth, effects.reverbRoomSize, effects.reverbDamping, effects.reverbWidth, effects.reverbLevel);
+  fluid_synth_set_chorus(synth, effects.chorusNr, effects.chorusLevel, effects.chorusSpeed, effects.chorusDepth, effects.chorusType);
+}
+
+static bool SameEffects(const EffectsState& a, const EffectsState& b){
+  return (a.reverbRoomSize == b.reverbRoomSize) && (a.reverbDamping == b.reverbDamping) &&
+    (a.reverbWidth == b.reverbWidth) && (a.reverbLevel == b.reverbLevel) &&
+    (a.chorusNr == b.chorusNr) && (a.chorusLevel == b.chorusLevel) && (a.chorusSpeed == b.chorusSpeed) &&
+    (a.chorusDepth == b.chorusDepth) && (a.chorusType == b.chorusType);
+}
+
+uint32 SynthState::applyChangesTo(fluid_synth_t* synth, const SynthState& applied) const {
+  uint32 programChanged = 0;
+  for(int ch = 0; ch < 16; ++ch){
+    const ChannelState& chState = channels[ch];
+    const ChannelState& was = applied.channels[ch];
+    if((chState.bank != was.bank) || (chState.program != was.program)){
+      fluid_synth_bank_select(synth, ch, chState.bank);
+      fluid_synth_program_change(synth, ch, chState.program);
+      programChanged |= 1 << ch;
+    }
+    if(chState.pitchWheelSens != was.pitchWheelSens)
+      fluid_synth_pitch_wheel_sens(synth, ch, chState.pitchWheelSens);
+    for(int ctrl = 0; ctrl < 128; ++ctrl){
+      if((chState.cc[ctrl] != was.cc[ctrl]) && IsStateController(ctrl))
+	fluid_synth_cc(synth, ch, ctrl, chState.cc[ctrl]);
+    }
+    if(chState.pitchBend != was.pitchBend)
+      fluid_synth_pitch_bend(synth, ch, chState.pitchBend);
+    if(chState.pressure != was.pressure)
+      fluid_synth_channel_pressure(synth, ch, chState.pressure);
+    for(int key = 0; key < 128; ++key){
+      if(chState.noteVelocity[key] == was.noteVelocity[key])
+	continue;
+      if(was.noteVelocity[key])
+	fluid_synth_noteoff(synth, ch, key);
+      if(chState.noteVelocity[key])
+	fluid_synth_noteon(synth, ch, key, chState.noteVelocity[key]);
+    }
+  }
+  if(!SameEffects(effects, applied.effects)){
+    fluid_synth_set_reverb(synth, effects.reverbRoomSize, effects.reverbDamping, effects.reverbWidth, effects.reverbLevel);
+    fluid_synth_set_chorus(synth, effects.chorusNr, effects.chorusLevel, effects.chorusSpeed, effects.chorusDepth, effects.chorusType);
+  }
+  return programChanged;
+}
+
+void SynthState::write(IBStreamer& streamer) const {
+  streamer.writeInt32(kStreamVersion);
+  streamer.writeInt32(kStreamSize);
+  for(auto const& chState : channels){
+    streamer.writeInt16(chState.bank);
+    streamer.writeInt16(chState.program);
+    streamer.writeInt16(chState.pitchBend);
+    streamer.writeInt16(chState.pitchWheelSens);
+    streamer.writeInt8u(chState.pressure);
+    streamer.writeRaw(chState.cc, sizeof(chState.cc));
+  }
+  streamer.writeDouble(effects.reverbRoomSize);
+  streamer.writeDouble(effects.reverbDamping);
+  streamer.writeDouble(effects.reverbWidth);
+  streamer.writeDouble(effects.reverbLevel);
+  streamer.writeInt32(effects.chorusNr);
+  streamer.writeDouble(effects.chorusLevel);
+  streamer.writeDouble(effects.chorusSpeed);
+  streamer.writeDouble(effects.chorusDepth);
+  streamer.writeInt32(effects.chorusType);
+}
+
+// Returns false when there is no (usable) snapshot, the state is not changed in this case
+bool SynthState::read(IBStreamer& streamer){
+  int32 version, size;
+  if(!streamer.readInt32(version) || !streamer.readInt32(size) || (version < 1) || (size < kStreamSize))
+    return false;
+  SynthState state;
+  for(auto& chState : state.channels){
+    int16 bank, program, pitchBend, pitchWheelSens;
+    uint8 pressure;
+    if(!streamer.readInt16(bank) || !streamer.readInt16(program) || !streamer.readInt16(pitchBend) ||
+       !streamer.readInt16(pitchWheelSens) || !streamer.readInt8u(pressure) ||
+       (streamer.readRaw(chState.cc, sizeof(chState.cc)) != sizeof(chState.cc)))
+      return false;
+    chState.bank = bank;
+    chState.program = std::max<int16>(0, std::min<int16>(program, 127));
+    chState.pitchBend = std::max<int16>(0, std::min<int16>(pitchBend, 16383));
+    chState.pitchWheelSens = pitchWheelSens;
+    chState.pressure = std::min<uint8>(pressure, 127);
+    for(auto& value : chState.cc)
+      value = std::min<uint8>(value, 127);
+  }
+  EffectsState& fx = state.effects;
+  if(!streamer.readDouble(fx.reverbRoomSize) || !streamer.readDouble(fx.reverbDamping) ||
+     !streamer.readDouble(fx.reverbWidth) || !streamer.readDouble(fx.reverbLevel) ||
+     !streamer.readInt32(fx.chorusNr) || !streamer.readDouble(fx.chorusLevel) ||
+     !streamer.readDouble(fx.chorusSpeed) || !streamer.readDouble(fx.chorusDepth) ||
+     !streamer.readInt32(fx.chorusType))
+    return false;
+  // newer versions append fields
+  if(size > kStreamSize)
+    streamer.seek(size - kStreamSize, kSeekCurrent);
+  *this = state;
+  return true;
+}
+
+void SynthState::noteOn(int ch, int key, int vel){
+  if((ch >= 0) && (ch < 16) && (key >= 0) && (key < 128))
+    channels[ch].noteVelocity[key] = vel;
+}
+
+void SynthState::noteOff(int ch, int key){
+  if((ch >= 0) && (ch < 16) && (key >= 0) && (key < 128))
+    channels[ch].noteVelocity[key] = 0;
+}
+
+void SynthState::allNotesOff(int ch){
+  if((ch >= 0) && (ch < 16))
+    memset(channels[ch].noteVelocity, 0, sizeof(channels[ch].noteVelocity));
+}
+
+
+// QualitySettings
+QualitySettings::QualitySettings() : interp(kInterp4th), polyphony(3), stealing(kStealDefault),
+				     reverb(true), chorus(true), autoTier(false) {
+  // FluidSynth defaults, 256 voices
+}
+
+void QualitySettings::write(IBStreamer& streamer) const {
+  streamer.writeInt32(kStreamVersion);
+  streamer.writeInt32(kStreamSize);
+  streamer.writeInt32(interp);
+  streamer.writeInt32(polyphony);
+  streamer.writeInt32(stealing);
+  streamer.writeInt32(reverb ? 1 : 0);
+  streamer.writeInt32(chorus ? 1 : 0);
+  streamer.writeInt32(autoTier ? 1 : 0);
+}
+
+bool QualitySettings::read(IBStreamer& streamer){
+  int32 version, size;
+  if(!streamer.readInt32(version) || !streamer.readInt32(size) || (version < 1) || (size < kStreamSize))
+    return false;
+  int32 values[6];
+  for(auto& value : values){
+    if(!streamer.readInt32(value))
+      return false;
+  }
+  interp = std::max(0, std::min(values[0], kInterpCount - 1));
+  polyphony = std::max(0, std::min(values[1], kPolyphonyCount - 1));
+  stealing = std::max(0, std::min(values[2], kStealCount - 1));
+  reverb = values[3] != 0;
+  chorus = values[4] != 0;
+  autoTier = values[5] != 0;
+  // newer versions append fields
+  if(size > kStreamSize)
+    streamer.seek(size - kStreamSize, kSeekCurrent);
+  return true;
+}
+
+// LayerSettings
+LayerSettings::LayerSettings(){
+  for(auto& layer : channels)
+    layer = 0;
+}
+
+void LayerSettings::write(IBStreamer& streamer) const {
+  int32 size = 4 + 16;
+  for(int32 layer = 1; layer < kMaxLayers; ++layer)
+    size += 4 + files[layer].size() + 1; // writeStr8 format
+  streamer.writeInt32(kStreamVersion);
+  streamer.writeInt32(size);
+  streamer.writeInt32(kMaxLayers);
+  for(int32 layer = 1; layer < kMaxLayers; ++layer)
+    streamer.writeStr8(files[layer].c_str());
+  for(auto layer : channels)
+    streamer.writeInt8u(layer);
+}
+
+// Returns false when there are no layers in the stream, the settings are not changed in this case
+bool LayerSettings::read(IBStreamer& streamer){
+  int32 version, size, count;
+  if(!streamer.readInt32(version) || !streamer.readInt32(size) || (version < 1) || (size < 4 + 16))
+    return false;
+  int64 start = streamer.tell();
+  if(!streamer.readInt32(count) || (count < 1))
+    return false;
+  LayerSettings settings;
+  for(int32 layer = 1; layer < count; ++layer){
+    char *fileName = streamer.readStr8();
+    if(fileName && (layer < kMaxLayers))
+      settings.files[layer] = fileName;
+    delete [] fileName;
+  }
+  for(auto& layer : settings.channels){
+    uint8 value;
+    if(!streamer.readInt8u(value))
+      return false;
+    layer = (value < kMaxLayers) ? value : 0;
+  }
+  // newer versions append fields
+  if(streamer.tell() > start + size)
+    return false;
+  streamer.seek(start + size, kSeekSet);
+  *this = settings;
+  return true;
+}
+
+// MidiTransform
+MidiTransform::MidiTransform(){
+  for(int32 ch = 0; ch < 16; ++ch)
+    channels[ch] = ChannelTransform{kVelLinear, 0, 0, 127, ch, kEventsAll};
+}
+
+void MidiTransform::write(IBStreamer& streamer) const {
+  streamer.writeInt32(kStreamVersion);
+  streamer.writeInt32(kStreamSize);
+  for(auto const& channel : channels){
+    streamer.writeInt8u(channel.velocity);
+    streamer.writeInt8(channel.transpose);
+    streamer.writeInt8u(channel.keyLow);
+    streamer.writeInt8u(channel.keyHigh);
+    streamer.writeInt8u(channel.channel);
+    streamer.writeInt8u(channel.events);
+  }
+}
+
+bool MidiTransform::read(IBStreamer& streamer){
+  int32 version, size;
+  if(!streamer.readInt32(version) || !streamer.readInt32(size) || (version < 1) || (size < kStreamSize))
+    return false;
+  MidiTransform transform;
+  for(auto& channel : transform.channels){
+    uint8 velocity, keyLow, keyHigh, output, events;
+    int8 transpose;
+    if(!streamer.readInt8u(velocity) || !streamer.readInt8(transpose) || !streamer.readInt8u(keyLow) ||
+       !streamer.readInt8u(keyHigh) || !streamer.readInt8u(output) || !streamer.readInt8u(events))
+      return false;
+    channel.velocity = std::min<int32>(velocity, kVelCurveCount - 1);
+    channel.transpose = std::max<int32>(-kMaxTranspose, std::min<int32>(transpose, kMaxTranspose));
+    channel.keyLow = std::min<int32>(keyLow, 127);
+    channel.keyHigh = std::min<int32>(keyHigh, 127);
+    channel.channel = std::min<int32>(output, 15);
+    channel.events = std::min<int32>(events, kEventsCount - 1);
+  }
+  // newer versions append fields
+  if(size > kStreamSize)
+    streamer.seek(size - kStreamSize, kSeekCurrent);
+  *this = transform;
+  return true;
+}
+
+// MidiTransformTables
+static uint8 CurveVelocity(int32 curve, int32 velocity){
+  switch(curve){
+    case kVelSoft: // louder soft notes
+      return std::max(1, (int32)(127. * std::pow(velocity / 127., 0.5) + 0.5));
+    case kVelHard:
+      return std::max(1, (int32)(127. * std::pow(velocity / 127., 2.) + 0.5));
+    case kVelFixed:
+      return kFixedVelocity;
+  }
+  return velocity;
+}
+
+void MidiTransformTables::compile(const MidiTransform& transform, int32 ch){
+  const ChannelTransform& settings = transform.channels[ch];
+  bool notes = (settings.events == kEventsAll) || (settings.events == kEventsNotes);
+  for(int32 i = 0; i < 128; ++i){
+    int32 outKey = i + settings.transpose;
+    key[ch][i] = (notes && (i >= settings.keyLow) && (i <= settings.keyHigh) && (outKey >= 0) && (outKey < 128)) ? outKey : -1;
+    velocity[ch][i] = i ? CurveVelocity(settings.velocity, i) : 0;
+  }
+  channel[ch] = settings.channel;
+  controllers[ch] = (settings.events == kEventsAll) || (settings.events == kEventsControllers);
+}
+
+void MidiTransformTables::compile(const MidiTransform& transform){
+  for(int32 ch = 0; ch < 16; ++ch)
+    compile(transform, ch);
+}
+
+// List parameters
+static int32 ListIndex(Vst::ParamValue value, int32 count){
+  return std::max(0, std::min(count - 1, (int32)(value*(count - 1) + 0.5)));
+}
+
+static Vst::ParamValue ListValue(int32 idx, int32 count){
+  return (Vst::ParamValue)idx / (count - 1);
+}
+
 
 // Processor
-Processor::Processor() : mSynth(NULL), mChangeSoundFont(false), mLoadingThread(0) /*, mAudioBufsSize(0) */ {
+
+// fluid_synth_process of FluidSynth 2.0 accepts 2 outputs only
+static bool CanProcessMultiOut(){
+  int major, minor, micro;
+  fluid_version(&major, &minor, &micro);
+  return (major > 2) || ((major == 2) && (minor >= 1));
+}
+
+// a point for each parameter: the plug-in own ones and 16 channels * (CCs + AT + PB)
+static const size_t kScheduleSize = kLastChEventsId + 1 + 16 * Vst::kCountCtrlNumber;
+
+Processor::Processor() : mSynth(NULL), mHotSwap(true), mStandbySynth(NULL), mStandbyGeneration(0), mFadeSynth(NULL), mFadeLength(0), mFadePos(0), mFadeBufsSize(0),
+			 mChangeSoundFont(false), mProcessFontIdx(-1), mProcessRebuilds(0), mTakenRebuilds(0), mSoundFontIndexGeneration(0), mMultiOut(false), mActiveOutputBusses(1 << kMainBus), mAudioBufsSize(0), mCpuCores(1), mThreadPrio(kDefaultThreadPrio), mScheduleDropped(0), mCtrlSynth(NULL), mCtrlGranularity(0), mBypassPos(0), mBypassLength(1), mIdle(false), mStandbyRelease(0.), mFontRelease(0.), mProcessing(false), mCaptureState(kCaptureIdle), mPendingState(NULL), mAppliedState(NULL), mLoadCaptureState(kCaptureIdle), mLoadCapture(0), mStandbyCapture(0), mPendingQuality(NULL), mAppliedQuality(NULL), mStealing(QualitySettings().stealing), mQualityChanged(false), mTier(0), mLoadAvg(0.), mTierHold(0), mOffline(false), mWaitedGeneration(0), mLockedBytes(0), mPendingTransform(NULL), mAppliedTransform(NULL), mMidiThru(false), mStreaming(false), mUnderruns(0), mUnderrunsSent(0), mRequestedGeneration(0), mLoadedGeneration(0) {
   setControllerClass(ControllerUID);
+  mSchedule.resize(kScheduleSize);
   mSynthSettings = new_fluid_settings();
-  mSynth = new_fluid_synth(mSynthSettings);
+  mHotSwap = GetOptions().hotSwap;
+  mMultiOut = GetOptions().multiOut && CanProcessMultiOut();
+  if(GetOptions().multiOut && !mMultiOut)
+    printf("Multiple outputs need FluidSynth 2.1 or later, this is %s\n", fluid_version_str());
+  mStreaming = GetOptions().stream;
+  mCtrlGranularity = GetOptions().ccGranularity;
+  resetCtrlValues();
+  mMidiThru = GetOptions().midiThru;
+  mTransformTables.compile(mTransform);
+  for(auto& notes : mPlayedNotes)
+    std::fill(std::begin(notes), std::end(notes), -1);
+  if(mMultiOut){
+    // each MIDI channel is rendered into own buffers
+    fluid_settings_setint(mSynthSettings, "synth.audio-channels", 16);
+    fluid_settings_setint(mSynthSettings, "synth.audio-groups", 16);
+  }
+  mFadeBufs[0] = NULL;
+  mFadeBufs[1] = NULL;
+  for(auto& retired : mRetiredSynths)
+    retired = NULL;
+  for(auto& soundFontIdx : mProcessLayerFonts)
+    soundFontIdx = -1;
+
+  mSynth = newSynth();
+  if(mSynth)
+    applyQuality(mSynth);
+
+  for(int32 ch = 0; ch < 16; ++ch){
+    mChannelPresets[ch] = (ch == 9) ? 128 * 128 : 0; // GM drums on channel 10
+    mChannelLayers[ch] = 0;
+  }
+  RegisterPrefetch(this);
 
   scanSoundFonts();
 
-  /*
-  mAudioBufs[0] = NULL;
-  mAudioBufs[1] = NULL;
-  */
+  for(auto& buf : mAudioBufs)
+    buf = NULL;
 }
 
-void Processor::syncedLoadSoundFont() {
-  char fileName[FILENAME_MAX];
-  GetPath(fileName, FILENAME_MAX);
-  PathAppend(fileName, FILENAME_MAX, mLoadedFile.text8());
+// Synth with our settings and module wide SoundFont cache
+fluid_synth_t* Processor::newSynth(){
+  // voice stealing and initial polyphony are only read when the synth is created.
+  // Voices are allocated for the maximum, applyQuality only lowers the polyphony.
+  static const double kOverflowAge[kStealCount]    = { 1000., 10000., 0. };
+  static const double kOverflowVolume[kStealCount] = { 500., 0., 10000. };
+  int32 stealing = mStealing;
+  std::lock_guard<std::mutex> lock(mSettingsMutex); // till the synth has read them
+  fluid_settings_setnum(mSynthSettings, "synth.overflow.age", kOverflowAge[stealing]);
+  fluid_settings_setnum(mSynthSettings, "synth.overflow.volume", kOverflowVolume[stealing]);
+  fluid_settings_setint(mSynthSettings, "synth.polyphony", QualitySettings::voices(kPolyphonyCount - 1));
+  // voice rendering threads are created with the synth, so not in process
+  fluid_settings_setint(mSynthSettings, "synth.cpu-cores", cpuCores());
+  fluid_settings_setint(mSynthSettings, "audio.realtime-prio", mOffline ? 0 : mThreadPrio.load());
+  fluid_synth_t* synth = new_fluid_synth(mSynthSettings);
+  if(synth){
+    fluid_sfloader_t* loader = NewSharedSoundFontLoader();
+    if(loader)
+      fluid_synth_add_sfloader(synth, loader); // it will be asked before default one
+  }
+  return synth;
+}
 
-  fluid_synth_all_notes_off(mSynth, -1);
-  fluid_synth_all_sounds_off(mSynth, -1);
-  if(fluid_synth_sfcount(mSynth) > 0){
-    // unload old one
-    int id = fluid_sfont_get_id(fluid_synth_get_sfont(mSynth, 0));
-    fluid_synth_sfunload(mSynth, id, 1);
+/*
+ * Load the main font and layer fonts into the synth, returns the main font id.
+ * info (when set) is for the main font, with the longest release of all.
+ */
+int32 Processor::loadFonts(fluid_synth_t* synth, const char *soundFontFile, Sf2Info* info){
+  char fileName[FILENAME_MAX];
+  std::string layerFiles[kMaxLayers];
+  std::string prefetchPaths[kMaxLayers]; // of loaded fonts, by layer
+  {
+    std::lock_guard<std::mutex> lock(mLayersMutex);
+    std::copy(std::begin(mLayers.files), std::end(mLayers.files), std::begin(layerFiles));
   }
-  if((mSoundFontID = fluid_synth_sfload(mSynth, fileName, 1)) == FLUID_FAILED){
+  double maxReleaseSec = 0.;
+  // layers first, so the main font is on top of the stack (searched first by layer 0 channels)
+  for(int32 layer = 1; layer < kMaxLayers; ++layer){
+    if(layerFiles[layer].empty())
+      continue;
+    GetSoundFontPath(layerFiles[layer].c_str(), fileName, FILENAME_MAX);
+    int32 id = fluid_synth_sfload(synth, fileName, 0);
+    if(id == FLUID_FAILED){
+      printf("Failed '%s'...\n", fileName);
+      continue;
+    }
+    fluid_synth_set_bank_offset(synth, id, layer * kLayerBankOffset);
+    prefetchPaths[layer] = fileName;
+    SoundFontFileInfo fileInfo;
+    if(info && GetSoundFontInfo(layerFiles[layer].c_str(), fileInfo))
+      maxReleaseSec = std::max(maxReleaseSec, fileInfo.sf2.maxReleaseSec);
+  }
+  GetSoundFontPath(soundFontFile, fileName, FILENAME_MAX);
+  int32 id = fluid_synth_sfload(synth, fileName, 1);
+  if(id == FLUID_FAILED){
     printf("Failed '%s'...\n", fileName);
+  } else {
+    if(info){
+      SoundFontFileInfo fileInfo;
+      if(GetSoundFontInfo(soundFontFile, fileInfo))
+	*info = fileInfo.sf2;
+      else
+	printf("Could not read SoundFont information from '%s'\n", fileName);
+    }
+    // before the synth is declared ready, so the first notes do not fault pages in
+    prefetchPaths[0] = fileName;
+    prefetchFonts(prefetchPaths);
+  }
+  if(info)
+    info->maxReleaseSec = std::max(info->maxReleaseSec, maxReleaseSec);
+  return id;
+}
+
+/*
+ * Load the font into a fresh synth, called by a loader worker.
+ * The current synth is not touched, so it can continue to play till
+ * the new one is adopted by checkSoundFont.
+ */
+// The channel state is replayed here, so process applies only what has changed since
+fluid_synth_t* Processor::loadSoundFont(const char *soundFontFile, Sf2Info& info, uint32& capture) {
+  deleteRetiredSynths();
+  capture = 0;
+  fluid_synth_t* synth = newSynth();
+  if(synth){
+    loadFonts(synth, soundFontFile, &info);
+    SynthState state;
+    if((capture = captureLoadState(state))){
+      state.applyTo(synth);
+      selectLayers(synth, state);
+    }
+  } else
+    printf("Could not create the synth for '%s'\n", soundFontFile);
+  return synth;
+}
+
+// From loader workers, returns the capture number or 0 when process has not captured (in time)
+uint32 Processor::captureLoadState(SynthState& state){
+  std::lock_guard<std::mutex> lock(mLoadCaptureMutex);
+  if(!mProcessing)
+    return 0;
+  mLoadCaptureState = kCaptureRequested;
+  for(int32 ms = 0; (mLoadCaptureState != kCaptureIdle) && (ms < kStateCaptureWaitMs); ++ms)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  int32 expected = kCaptureRequested;
+  if(mLoadCaptureState.compare_exchange_strong(expected, kCaptureIdle))
+    return 0;
+  while(mLoadCaptureState != kCaptureIdle) // process is capturing just now
+    std::this_thread::yield();
+  state = mLoadSnapshot;
+  return mLoadCapture;
+}
+
+// From process, cheap reading of the synth in comparison with replaying it
+void Processor::serveLoadCapture(){
+  int32 expected = kCaptureRequested;
+  if(!mLoadCaptureState.compare_exchange_strong(expected, kCaptureBusy))
+    return;
+  if(mSynth){
+    mLoadSnapshot.captureFrom(mSynth);
+    for(int ch = 0; ch < 16; ++ch){
+      mLoadSnapshot.channels[ch].pressure = mSynthState.channels[ch].pressure;
+      memcpy(mLoadSnapshot.channels[ch].noteVelocity, mSynthState.channels[ch].noteVelocity,
+	     sizeof(mLoadSnapshot.channels[ch].noteVelocity));
+    }
+    if(!++mLoadCapture)
+      ++mLoadCapture;
+  } else
+    mLoadCapture = 0; // nothing to replay
+  mLoadCaptureState = kCaptureIdle;
+}
+
+// Publish loaded synth for checkSoundFont, unless it is already superseded
+void Processor::completeLoading(fluid_synth_t* synth, const Sf2Info& info, uint32 generation, uint32 capture){
+  if(synth && isCurrentRequest(generation)){
+    mStandbyGeneration = generation;
+    mStandbyCapture = capture;
+    mStandbyRelease = info.maxReleaseSec;
+    synth = mStandbySynth.exchange(synth); // not yet adopted previous one, if any
   }
-  mLoadingComplete = true;
+  if(synth)
+    delete_fluid_synth(synth);
+  deleteRetiredSynths();
 }
 
 Processor::~Processor() {
-  checkSoundFont(true); // to stop the thread, if any
+  CancelSoundFontRequests(this);
+  {
+    std::lock_guard<std::mutex> lock(mPrefetchMutex);
+    unlockPresets(false);
+  }
+  if(fluid_synth_t* synth = mStandbySynth.exchange(NULL))
+    delete_fluid_synth(synth);
   if(mSynth){
     delete_fluid_synth(mSynth);
     mSynth = NULL;
   }
+  if(mFadeSynth){
+    delete_fluid_synth(mFadeSynth);
+    mFadeSynth = NULL;
+  }
+  deleteRetiredSynths();
+  delete mPendingState.exchange(NULL);
+  delete mAppliedState.exchange(NULL);
+  delete mPendingTransform.exchange(NULL);
+  delete mAppliedTransform.exchange(NULL);
+  delete mPendingQuality.exchange(NULL);
+  delete mAppliedQuality.exchange(NULL);
+  if(mFadeBufs[0])
+    delete [] mFadeBufs[0];
+  if(mFadeBufs[1])
+    delete [] mFadeBufs[1];
   if(mSynthSettings){
     delete_fluid_settings(mSynthSettings);
     mSynthSettings = NULL;
   }
-  /*
-  if(mAudioBufs[0])
-    delete [] mAudioBufs[0];
-  if(mAudioBufs[1])
-    delete [] mAudioBufs[1];
-    */
+  for(auto buf : mAudioBufs){
+    if(buf)
+      delete [] buf;
+  }
 }
 
 tresult PLUGIN_API Processor::initialize(FUnknown* context){
@@ -220,278 +829,1287 @@ tresult PLUGIN_API Processor::initialize(FUnknown* context){
   if(result == kResultTrue){
     addAudioInput(STR16("AudioInput"), Vst::SpeakerArr::kStereo);
     addAudioOutput(STR16("AudioOutput"), Vst::SpeakerArr::kStereo);
+    if(mMultiOut){
+      // not active by default, the host activates what the user has connected
+      for(int32 ch = 0; ch < 16; ++ch){
+	String busName;
+	busName.printf(STR16("Ch%d"), ch + 1);
+	addAudioOutput(busName, Vst::SpeakerArr::kStereo, Vst::kAux, 0);
+      }
+      addAudioOutput(STR16("Reverb"), Vst::SpeakerArr::kStereo, Vst::kAux, 0);
+      addAudioOutput(STR16("Chorus"), Vst::SpeakerArr::kStereo, Vst::kAux, 0);
+    }
     addEventInput(STR16("MIDIInput"), 16);
+    if(mMidiThru)
+      addEventOutput(STR16("MIDIOutput"), 16);
+    StartSoundFontLoader(); // not from process
+  }
+  return result;
+}
+
+tresult PLUGIN_API Processor::setBusArrangements(Vst::SpeakerArrangement* inputs, int32 numIns,
+						 Vst::SpeakerArrangement* outputs, int32 numOuts){
+  if((numIns == 1) && (numOuts >= 1) && (numOuts <= (mMultiOut ? kMaxOutputBusses : 1))){
+    // all busses are the same as input (stereo)
+    for(int32 bus = 0; bus < numOuts; ++bus){
+      if(inputs[0] != outputs[bus])
+	return kResultFalse;
+    }
+    return AudioEffect::setBusArrangements(inputs, numIns, outputs, numOuts);
+  }
+  return kResultFalse;
+}
+
+tresult PLUGIN_API Processor::activateBus(Vst::MediaType type, Vst::BusDirection dir, int32 index, TBool state){
+  tresult result = AudioEffect::activateBus(type, dir, index, state);
+  if((result == kResultTrue) && (type == Vst::kAudio) && (dir == Vst::kOutput) && (index >= 0) && (index < kMaxOutputBusses)){
+    if(state)
+      mActiveOutputBusses |= (1 << index);
+    else
+      mActiveOutputBusses &= ~(1 << index);
+  }
+  return result;
+}
+
+/*
+ * The longest release of the current font plus reverb decay, so the host can stop
+ * calling process after that time without notes.
+ * Reverb decay is FluidSynth 2.0 (FDN) mapping of room size.
+ */
+uint32 PLUGIN_API Processor::getTailSamples(){
+  double tail = mFontRelease.load();
+  int reverbActive = 1;
+  double roomSize = 0.;
+  fluid_settings_getint(mSynthSettings, "synth.reverb.active", &reverbActive);
+  if(reverbActive && mQuality.reverb && (fluid_settings_getnum(mSynthSettings, "synth.reverb.room-size", &roomSize) == FLUID_OK))
+    tail += kReverbMinDecaySec + (kReverbMaxDecaySec - kReverbMinDecaySec) * roomSize;
+  return (uint32)(tail * processSetup.sampleRate) + 1;
+}
+
+tresult PLUGIN_API Processor::canProcessSampleSize(int32 symbolicSampleSize){
+  if((symbolicSampleSize == Vst::kSample32) || (symbolicSampleSize == Vst::kSample64))
+    return kResultTrue;
+  // Well, FluidSynth has compile time fixed precision. And it is default to 64bit... But
+  // fluid_synth_write_float unconditionally writes "float", so for 64bit we convert (see writeAudio)
+  return kResultFalse;
+}
+
+tresult PLUGIN_API Processor::setupProcessing(Vst::ProcessSetup& setup){
+  tresult result = AudioEffect::setupProcessing(setup);
+  if(result == kResultTrue){
+    //printf("Processor: SetupProcessing\n");
+    // FluidSynth renders in own fixed size blocks, so only our buffers depend on the block size (below).
+    // The sample rate is used when the synth is created.
+    double sampleRate = 0.;
+    bool rebuild = false;
+    {
+      std::lock_guard<std::mutex> lock(mSettingsMutex); // loader workers can create a synth
+      fluid_settings_getnum(mSynthSettings, "synth.sample-rate", &sampleRate);
+      if(sampleRate != setup.sampleRate){
+	if(fluid_settings_setnum(mSynthSettings, "synth.sample-rate", setup.sampleRate) == FLUID_FAILED)
+	  printf("Could not set sample rate to %f\n", setup.sampleRate);
+	else
+	  rebuild = true;
+      }
+    }
+    // offline (bounce, freeze) is rendered with the best quality and all cores
+    bool offline = (setup.processMode == Vst::kOffline);
+    if(offline != mOffline){
+      int32 cores = cpuCores();
+      mOffline = offline;
+      rebuild = rebuild || (cores != cpuCores());
+      mQualityChanged = true;
+    }
+    if(rebuild && !rebuildSynth())
+      requestRebuild();
+    // BAD SDK:
+    //   from common sense, we should not load any sound font till we know which one should be loaded
+    //   but reality is different. REAPER calls setupProcessing before setState, even in case it is
+    //   called later (the plug-in is instantiated from a project, from saved state).
+    //   In case last getState returns the same as default getState, setState is not called at all.
+    //   Finally, if plug-in is just instantiated, setState should not be called. And so,
+    //   we have no way to check the user wants not default font in this instance, we are forced
+    //   to always load default first.
+    //   With loader workers default font request is delayed, so normally replaced by setState one.
+    refreshSoundFonts();
+    bool isDefault = false;
+    int32 soundFontIdx = getCurrentSoundFontIdx();
+    {
+      std::lock_guard<std::mutex> lock(mFontMutex);
+      if(!mSoundFontFile.text8()[0]){
+	mSoundFontFile = mSoundFontFiles.at(soundFontIdx); // we know the list is not emply
+	mChangeSoundFont = true;
+	isDefault = true;
+      }
+    }
+    requestSoundFont(isDefault);
+    deleteRetiredSynths();
+    // cross fade buffers for hot swap, we should be called with real time stopped
+    mFadeLength = setup.sampleRate * kCrossfadeMs / 1000;
+    mBypassLength = std::max(1, (int32)(setup.sampleRate * kBypassRampMs / 1000));
+    mBypassPos = mBypass ? mBypassLength : 0;
+    if(mFadeBufsSize < setup.maxSamplesPerBlock){
+      if(mFadeBufs[0])
+	delete [] mFadeBufs[0];
+      if(mFadeBufs[1])
+	delete [] mFadeBufs[1];
+      mFadeBufs[0] = new float[setup.maxSamplesPerBlock];
+      mFadeBufs[1] = new float[setup.maxSamplesPerBlock];
+      mFadeBufsSize = setup.maxSamplesPerBlock;
+    }
+    // block schedule, so process does not allocate. The last point of each parameter always
+    // fits, plus a sample worth of events or intermediate points (more events are scheduled
+    // in the next walk, more points are thinned).
+    size_t scheduleSize = kScheduleSize + setup.maxSamplesPerBlock;
+    if(mSchedule.size() < scheduleSize)
+      mSchedule.resize(scheduleSize);
+    if((setup.symbolicSampleSize == Vst::kSample64) && (mAudioBufsSize < setup.maxSamplesPerBlock)){
+      // we should be called with real time stopped, 2 buffers per declared bus
+      int32 numBufs = mMultiOut ? kMaxOutputBusses*2 : 2;
+      mAudioBufsSize = setup.maxSamplesPerBlock;
+      for(int32 i = 0; i < numBufs; ++i){
+	if(mAudioBufs[i])
+	  delete [] mAudioBufs[i];
+	mAudioBufs[i] = new float[setup.maxSamplesPerBlock + 1];
+	if(!mAudioBufs[i])
+	  mAudioBufsSize = 0;
+      }
+    }
+  }
+  return result;
+}
+
+tresult PLUGIN_API Processor::setActive(TBool state){
+  tresult result = AudioEffect::setActive(state);
+  if(result == kResultTrue){
+    if(state){
+      //printf("Processor: activated\n");
+      refreshSoundFonts();
+    } else {
+      //printf("Processor: deactivated\n");
+      deleteRetiredSynths();
+      // process is not called, so the synth is ours
+      if(mSynth && isSoundFontLoaded() && !mPendingState)
+	mSnapshot.captureFrom(mSynth);
+    }
+  }
+  return result;
+}
+
+/*
+ * Render into float buffers, 2 per output bus, NULL for not used busses.
+ * Main bus buffers should always be there. Returns true when the output is silent.
+ *
+ * In multi output mode MIDI channels go to own bus when it is active, fx go to
+ * reverb/chorus bus when they are active. Everything else goes to the main bus.
+ * fluid_synth_process mixes, so we can simply point unused busses to the main one.
+ * Otherwise the synth has one stereo output, written with fluid_synth_write_float.
+ */
+bool Processor::renderAudio(float **outputs, int32 numOutputs, int32 numSamples){
+  for(int32 bus = 0; bus < numOutputs; ++bus){
+    if(outputs[bus*2]){
+      memset(outputs[bus*2], 0, sizeof(float) * numSamples);
+      memset(outputs[bus*2 + 1], 0, sizeof(float) * numSamples);
+    }
+  }
+  if(!checkSoundFont()){
+    // the synth is not ready
+    return true;
+  }
+  if(mIdle && !mFadeSynth && (fluid_synth_get_active_voice_count(mSynth) == 0)){
+    // nothing sounds, including effects, no reason to call the synth
+    return true;
+  }
+  if(mMultiOut){
+    float *out[32];
+    for(int32 ch = 0; ch < 16; ++ch){
+      int32 bus = kFirstChannelBus + ch;
+      if((bus >= numOutputs) || !outputs[bus*2])
+	bus = kMainBus;
+      out[ch*2] = outputs[bus*2];
+      out[ch*2 + 1] = outputs[bus*2 + 1];
+    }
+    float *fx[4]; // reverb L/R, chorus L/R
+    int32 fxBus[2] = { kReverbBus, kChorusBus };
+    for(int32 i = 0; i < 2; ++i){
+      int32 bus = fxBus[i];
+      if((bus >= numOutputs) || !outputs[bus*2])
+	bus = kMainBus;
+      fx[i*2] = outputs[bus*2];
+      fx[i*2 + 1] = outputs[bus*2 + 1];
+    }
+    if(fluid_synth_process(mSynth, numSamples, 4, fx, 32, out) == FLUID_FAILED){
+      //printf("Generation failed\n");
+    }
+  } else if(fluid_synth_write_float(mSynth, numSamples, outputs[kMainBus*2], 0, 1, outputs[kMainBus*2 + 1], 0, 1) == FLUID_FAILED){
+    //printf("Generation failed\n");
+  }
+  if(mFadeSynth){
+    writeCrossfade(outputs, numOutputs, numSamples);
+    mIdle = false;
+  } else if(fluid_synth_get_active_voice_count(mSynth) > 0){
+    mIdle = false;
+  } else {
+    // reverb and chorus tails can still sound
+    float peak = 0.f;
+    for(int32 i = 0; i < numOutputs*2; ++i){
+      if(outputs[i]){
+	for(int32 j = 0; j < numSamples; ++j)
+	  peak = std::max(peak, fabsf(outputs[i][j]));
+      }
+    }
+    mIdle = (peak < kSilenceLevel);
+  }
+  return false;
+}
+
+// Returns true when written silence
+bool Processor::writeAudio(Vst::ProcessData& data, int32 start_sample, int32 end_sample){ // end_sample is exclusive
+  if((data.numSamples < end_sample) || (start_sample >= end_sample) || (data.numOutputs < 1) || (data.outputs[0].numChannels < 2))
+    return false;
+
+  float *outputs[kMaxOutputBusses*2];
+  int32 numOutputs = std::min(data.numOutputs, (int32)kMaxOutputBusses);
+  if(data.symbolicSampleSize == Vst::kSample32){
+    for(int32 bus = 0; bus < numOutputs; ++bus){
+      if(isOutputBusUsed(data, bus)){
+	outputs[bus*2] = data.outputs[bus].channelBuffers32[0] + start_sample;
+	outputs[bus*2 + 1] = data.outputs[bus].channelBuffers32[1] + start_sample;
+      } else
+	outputs[bus*2] = outputs[bus*2 + 1] = NULL;
+    }
+    return renderAudio(outputs, numOutputs, end_sample - start_sample);
+  } else if(mAudioBufsSize > 0){
+    // fluid_synth_write_double does not exist (yet), so render into float buffers and convert
+    for(int32 bus = 0; bus < numOutputs; ++bus){
+      if(isOutputBusUsed(data, bus)){
+	outputs[bus*2] = mAudioBufs[bus*2];
+	outputs[bus*2 + 1] = mAudioBufs[bus*2 + 1];
+      } else
+	outputs[bus*2] = outputs[bus*2 + 1] = NULL;
+    }
+    bool silent = true;
+    int32 sample = start_sample;
+    while(sample < end_sample){
+      int32 n = std::min(end_sample - sample, mAudioBufsSize);
+      silent = renderAudio(outputs, numOutputs, n) && silent;
+      for(int32 bus = 0; bus < numOutputs; ++bus){
+	if(outputs[bus*2]){
+	  FloatToDouble(outputs[bus*2], data.outputs[bus].channelBuffers64[0] + sample, n);
+	  FloatToDouble(outputs[bus*2 + 1], data.outputs[bus].channelBuffers64[1] + sample, n);
+	}
+      }
+      sample += n;
+    }
+    return silent;
+  }
+  return false;
+}
+
+// Main bus is always used, other only when active and host has given buffers
+bool Processor::isOutputBusUsed(Vst::ProcessData& data, int32 bus){
+  if(bus == kMainBus)
+    return true;
+  return (mActiveOutputBusses & (1 << bus)) && (data.outputs[bus].numChannels >= 2) &&
+    (data.symbolicSampleSize == Vst::kSample32 ? data.outputs[bus].channelBuffers32 != NULL : data.outputs[bus].channelBuffers64 != NULL);
+}
+
+/*
+ * Mix fading out synth into just rendered output of the current one.
+ * The current is faded in on all busses, the old one goes to the main bus only.
+ */
+void Processor::writeCrossfade(float **outputs, int32 numOutputs, int32 numSamples){
+  int32 pos = 0;
+  while(pos < numSamples){
+    int32 n = std::min(numSamples - pos, mFadeBufsSize);
+    if(mMultiOut){
+      // all channels and fx of the old synth, mixed
+      float *out[32], *fx[4];
+      for(int32 i = 0; i < 32; ++i)
+	out[i] = mFadeBufs[i % 2];
+      for(int32 i = 0; i < 4; ++i)
+	fx[i] = mFadeBufs[i % 2];
+      memset(mFadeBufs[0], 0, sizeof(float) * n);
+      memset(mFadeBufs[1], 0, sizeof(float) * n);
+      fluid_synth_process(mFadeSynth, n, 4, fx, 32, out);
+    } else if(fluid_synth_write_float(mFadeSynth, n, mFadeBufs[0], 0, 1, mFadeBufs[1], 0, 1) == FLUID_FAILED){
+      memset(mFadeBufs[0], 0, sizeof(float) * n);
+      memset(mFadeBufs[1], 0, sizeof(float) * n);
+    }
+    int32 fadePos = mFadePos;
+    for(int32 bus = 0; bus < numOutputs; ++bus){
+      if(!outputs[bus*2])
+	continue;
+      float *left = outputs[bus*2] + pos;
+      float *right = outputs[bus*2 + 1] + pos;
+      fadePos = mFadePos;
+      for(int32 i = 0; i < n; ++i){
+	float gain = (fadePos < mFadeLength) ? (float)fadePos / mFadeLength : 1.f;
+	left[i]  *= gain;
+	right[i] *= gain;
+	if(bus == kMainBus){
+	  left[i]  += mFadeBufs[0][i] * (1.f - gain);
+	  right[i] += mFadeBufs[1][i] * (1.f - gain);
+	}
+	if(fadePos < mFadeLength)
+	  ++fadePos;
+      }
+    }
+    mFadePos = fadePos;
+    pos += n;
+  }
+  if((mFadePos >= mFadeLength) && retireSynth(mFadeSynth))
+    mFadeSynth = NULL;
+}
+
+/*
+ * Collect parameter points and events of the block into mSchedule, ordered by sample offset.
+ * At the same offset parameter changes go first, as they were played before events in the past.
+ * Offsets are clamped into [0, numSamples], so late changes are played at the end of the block.
+ * Events are collected first and the last point of each queue (the final value) is always
+ * kept, only intermediate points can be dropped when the schedule is full. Events which have
+ * not fit are left for the next call, nextEvent is -1 when all are collected. Points after
+ * the last collected event wait for the next call too, so they are not played before
+ * earlier events: each call takes points in (fromOffset, the limit] and moves fromOffset
+ * (-1 for the first call). Return the number of items in the schedule.
+ */
+int32 Processor::buildSchedule(Vst::ProcessData& data, int32& nextEvent, int32& fromOffset){
+  auto clampOffset = [&data](int32 sampleOffset){
+    return std::max(0, std::min(sampleOffset, data.numSamples));
+  };
+  int32 count = 0;
+  int32 capacity = mSchedule.size();
+  int32 numQueues = data.inputParameterChanges ? data.inputParameterChanges->getParameterCount() : 0;
+  int32 evcount = data.inputEvents ? data.inputEvents->getEventCount() : 0;
+  int32 evcapacity = std::max(1, capacity - numQueues); // the rest is for the last points
+  int32 index = nextEvent;
+  int32 toOffset = fromOffset;
+  for(; (index < evcount) && (count < evcapacity); ++index){
+    ScheduledItem& item = mSchedule[count];
+    if(data.inputEvents->getEvent(index, item.event) == kResultTrue){
+      item.sampleOffset = clampOffset(item.event.sampleOffset);
+      item.order = count;
+      item.isEvent = true;
+      toOffset = std::max(toOffset, item.sampleOffset);
+      ++count;
+    }
+  }
+  nextEvent = (index < evcount) ? index : -1;
+  if(nextEvent < 0)
+    toOffset = data.numSamples;
+  for(int32 queue = 0; queue < numQueues; ++queue){
+    Vst::IParamValueQueue* paramQueue = data.inputParameterChanges->getParameterData(queue);
+    int32 numPoints = paramQueue ? paramQueue->getPointCount() : 0;
+    if(numPoints <= 0)
+      continue;
+    Vst::ParamID id = paramQueue->getParameterId();
+    int32 ch, ctrlNumber;
+    int32 granularity = (IsCCParam(id, ch, ctrlNumber) && IsValueCtrl(ctrlNumber)) ? mCtrlGranularity : 0;
+    int32 first = count, lastOffset = 0;
+    // slots for the last point of this and following queues
+    int32 reserved = numQueues - queue;
+    for(int32 point = 0; point < numPoints; ++point){
+      int32 sampleOffset, nextOffset;
+      Vst::ParamValue value, nextValue;
+      if(paramQueue->getPoint(point, sampleOffset, value) != kResultTrue)
+	continue;
+      sampleOffset = clampOffset(sampleOffset);
+      if(sampleOffset <= fromOffset)
+	continue; // taken by the previous call
+      if(sampleOffset > toOffset)
+	break; // points in a queue are time ordered
+      // the last of the queue in this call
+      bool isLast = (point == numPoints - 1) ||
+	(paramQueue->getPoint(point + 1, nextOffset, nextValue) != kResultTrue) || (clampOffset(nextOffset) > toOffset);
+      if(count >= capacity - (isLast ? 0 : reserved)){
+	++mScheduleDropped;
+	continue;
+      }
+      // too close to the previous one, but the last point sets the exact final value
+      if((granularity > 0) && (count > first) && !isLast &&
+	 (sampleOffset - lastOffset < granularity))
+	continue;
+      lastOffset = sampleOffset;
+      ScheduledItem& item = mSchedule[count];
+      item.sampleOffset = sampleOffset;
+      item.value = value;
+      item.order = count;
+      item.id = id;
+      item.isEvent = false;
+      ++count;
+    }
+  }
+  fromOffset = toOffset;
+  // points in each queue and events are normally time ordered already, so that is almost linear
+  // (std::sort does not allocate)
+  std::sort(mSchedule.begin(), mSchedule.begin() + count, [](const ScheduledItem& a, const ScheduledItem& b){
+      if(a.sampleOffset != b.sampleOffset)
+	return a.sampleOffset < b.sampleOffset;
+      if(a.isEvent != b.isEvent)
+	return b.isEvent;
+      return a.order < b.order;
+    });
+  return count;
+}
+
+void Processor::playParChange(Vst::ProcessData& data, Vst::ParamID id, Vst::ParamValue value){
+  switch(id){
+    case FluidSynthVSTParams::kBypassId:
+      mBypass = (value > 0.5f);
+      break;
+    case FluidSynthVSTParams::kRootPrgId:
+      // we can not change here, loader workers check it is a different font and load it
+      if(mSoundFontFiles.size()){
+	//printf("Processor: font change request\n");
+	mProcessFontIdx = (int32)(value*(mSoundFontFiles.size()-1) + 0.5);
+	WakeSoundFontLoader();
+      }
+      break;
+    case FluidSynthVSTParams::kCpuCoresId:
+    case FluidSynthVSTParams::kThreadPrioId:
+      // the synth should be recreated
+      if(setThreading(id == kCpuCoresId ? (int32)(value*(kMaxCpuCores - 1) + 1.5) : mCpuCores.load(),
+		      id == kThreadPrioId ? (int32)(value*kMaxThreadPrio + 0.5) : mThreadPrio.load()))
+	requestRebuild();
+      break;
+    case FluidSynthVSTParams::kInterpId:
+      mQuality.interp = ListIndex(value, kInterpCount);
+      mQualityChanged = true;
+      break;
+    case FluidSynthVSTParams::kPolyphonyId:
+      mQuality.polyphony = ListIndex(value, kPolyphonyCount);
+      mQualityChanged = true;
+      break;
+    case FluidSynthVSTParams::kReverbOnId:
+      mQuality.reverb = (value > 0.5f);
+      mQualityChanged = true;
+      break;
+    case FluidSynthVSTParams::kChorusOnId:
+      mQuality.chorus = (value > 0.5f);
+      mQualityChanged = true;
+      break;
+    case FluidSynthVSTParams::kStealingId:
+      if(mQuality.stealing != ListIndex(value, kStealCount)){
+	mQuality.stealing = ListIndex(value, kStealCount);
+	mStealing = mQuality.stealing; // before the request, for the worker
+	requestRebuild();
+      }
+      break;
+    case FluidSynthVSTParams::kAutoQualityId:
+      mQuality.autoTier = (value > 0.5f);
+      mTier = 0;
+      mLoadAvg = 0.;
+      mQualityChanged = true;
+      break;
+    case FluidSynthVSTParams::kLayerFontId:
+    case FluidSynthVSTParams::kLayerFontId + 1:
+    case FluidSynthVSTParams::kLastLayerFontId: {
+      // the first list entry is "None", fonts are loaded into a new synth (by loader workers)
+      mProcessLayerFonts[id - kLayerFontId] = ListIndex(value, mSoundFontFiles.size() + 1);
+      WakeSoundFontLoader();
+      break;
+    }
+    default:
+      if((id >= kChVelocityId) && (id <= kLastChEventsId)){
+	setTransform(id, value);
+	break;
+      }
+      if((id >= kChLayerId) && (id <= kLastChLayerId)){
+	int32 ch = id - kChLayerId;
+	int32 layer = ListIndex(value, kMaxLayers);
+	int sfontId, bank, program;
+	if((mChannelLayers[ch].exchange(layer) != layer) && checkSoundFont() &&
+	   (fluid_synth_get_program(mSynth, ch, &sfontId, &bank, &program) == FLUID_OK))
+	  selectProgram(mSynth, ch, program);
+	break;
+      }
+      if(!checkSoundFont()){
+	// the synth is not ready
+	break;
+      }
+      if(id >= 1024){
+	int32 ch = id / 1024 - 1;
+	int32 ctrlNumber = id%1024;
+	if(ch < 16){
+	  if(!mTransformTables.controllers[ch])
+	    break; // filtered
+	  ch = mTransformTables.channel[ch];
+	}
+	int32 ctrlValue = CtrlValue(ctrlNumber, value);
+	if(!ctrlChanged(ch, ctrlNumber, ctrlValue))
+	  break; // the synth has it already
+	if(ctrlNumber < Vst::kAfterTouch){ // CC
+	  fluid_synth_cc(mSynth, ch, ctrlNumber, ctrlValue);
+	  if((ctrlNumber == Vst::kCtrlAllSoundsOff) || (ctrlNumber == Vst::kCtrlAllNotesOff))
+	    mSynthState.allNotesOff(ch);
+	  //printf("Ch:%d CC%d = %d\n", ch, ctrlNumber, ctrlValue);
+	} else if(ctrlNumber == Vst::kAfterTouch){
+	  fluid_synth_channel_pressure(mSynth, ch, ctrlValue);
+	  mSynthState.channels[ch].pressure = ctrlValue;
+	  //printf("Ch:%d AT = %d\n", ch, ctrlValue);
+	} else if(ctrlNumber == Vst::kPitchBend){
+	  fluid_synth_pitch_bend(mSynth, ch, ctrlValue);
+	  //printf("Ch:%d PB = %d\n", ch, ctrlValue - 8192);
+	} else {
+	  TelemetryLog(mTelemetry, kTelUnknownCtrl, ch, ctrlNumber);
+	}
+      } else if((id >= kChPrgId) && (id <= kLastChPrgId)){ // PC
+	int32 ch = id - kChPrgId;
+	int sfontId, bank, program;
+	selectProgram(mSynth, ch, value*127.+0.5);
+	if(fluid_synth_get_program(mSynth, ch, &sfontId, &bank, &program) == FLUID_OK)
+	  queuePrefetch(ch, bank, program);
+      } else {
+	TelemetryLog(mTelemetry, kTelUnknownParam, id);
+      }
+      // TODO: also send as "legacy MIDI events"
+  }
+}
+
+// False when the synth has the value already. The values are forgotten when the synth
+// is changed and for the channel on mode messages (reset all controllers...)
+bool Processor::ctrlChanged(int32 ch, int32 ctrlNumber, int32 value){
+  if(mCtrlSynth != mSynth){
+    resetCtrlValues();
+    mCtrlSynth = mSynth;
+  }
+  if((ch < 0) || (ch >= 16) || (ctrlNumber >= Vst::kCountCtrlNumber))
+    return true;
+  if(!IsValueCtrl(ctrlNumber)){
+    if((ctrlNumber >= Vst::kCtrlAllSoundsOff) && (ctrlNumber < Vst::kAfterTouch))
+      resetCtrlValues(ch);
+    return true;
+  }
+  if(mCtrlValues[ch][ctrlNumber] == value)
+    return false;
+  mCtrlValues[ch][ctrlNumber] = value;
+  return true;
+}
+
+void Processor::resetCtrlValues(int32 ch){
+  for(int32 i = 0; i < 16; ++i){
+    if((ch < 0) || (ch == i))
+      std::fill(std::begin(mCtrlValues[i]), std::end(mCtrlValues[i]), -1);
+  }
+}
+
+// Parameters of MIDI transform, compiled at once for the channel
+void Processor::setTransform(Vst::ParamID id, Vst::ParamValue value){
+  int32 ch = (id - kChVelocityId) % 16;
+  ChannelTransform& settings = mTransform.channels[ch];
+  switch(id - ch){
+    case kChVelocityId:
+      settings.velocity = ListIndex(value, kVelCurveCount);
+      break;
+    case kChTransposeId:
+      settings.transpose = (int32)(value*2*kMaxTranspose + 0.5) - kMaxTranspose;
+      break;
+    case kChKeyLowId:
+      settings.keyLow = value*127. + 0.5;
+      break;
+    case kChKeyHighId:
+      settings.keyHigh = value*127. + 0.5;
+      break;
+    case kChOutputId:
+      settings.channel = ListIndex(value, 16);
+      break;
+    case kChEventsId:
+      settings.events = ListIndex(value, kEventsCount);
+      break;
+  }
+  mTransformTables.compile(mTransform, ch);
+}
+
+void Processor::playEvent(Vst::ProcessData& data, Vst::Event& e){
+  switch(e.type){
+    case Vst::Event::kNoteOnEvent: {
+      if(mBypass)
+	break; // fading out or bypassed
+      int32 ch = e.noteOn.channel, key = e.noteOn.pitch;
+      if((ch < 0) || (ch >= 16) || (key < 0) || (key >= 128) || (mTransformTables.key[ch][key] < 0))
+	break;
+      int32 outCh = mTransformTables.channel[ch];
+      int32 outKey = mTransformTables.key[ch][key];
+      int32 velocity = mTransformTables.velocity[ch][std::max(0, std::min((int32)(e.noteOn.velocity*127. + 0.5), 127))];
+      int16& played = mPlayedNotes[ch][key];
+      if((played >= 0) && (played != outCh * 128 + outKey)){ // the transform is changed while the key is held
+	fluid_synth_noteoff(mSynth, played / 128, played % 128);
+	mSynthState.noteOff(played / 128, played % 128);
+      }
+      if(fluid_synth_noteon(mSynth, outCh, outKey, velocity) == FLUID_FAILED){
+	//printf("NoteOn failed\n");
+      }
+      mSynthState.noteOn(outCh, outKey, velocity);
+      played = velocity ? outCh * 128 + outKey : -1;
+      break;
+    }
+    case Vst::Event::kNoteOffEvent: {
+      // where the note was played, transform settings could change since
+      int32 ch = e.noteOff.channel, key = e.noteOff.pitch;
+      if((ch < 0) || (ch >= 16) || (key < 0) || (key >= 128) || (mPlayedNotes[ch][key] < 0))
+	break;
+      int32 played = mPlayedNotes[ch][key];
+      mPlayedNotes[ch][key] = -1;
+      fluid_synth_noteoff(mSynth, played / 128, played % 128);
+      mSynthState.noteOff(played / 128, played % 128);
+      break;
+    }
+    default:
+      // TODO: at least SysEx
+      TelemetryLog(mTelemetry, kTelUnknownEvent, e.type);
+  }
+  if(mMidiThru && data.outputEvents)
+    data.outputEvents->addEvent(e);
+}
+
+tresult PLUGIN_API Processor::process(Vst::ProcessData& data){
+  //printf("*\n");
+
+  if((data.numOutputs <= 0) || (data.numSamples <= 0))
+    return kResultOk;
+
+  TelemetryProbe probe(mTelemetry, kTelBlock);
+  if(mPendingQuality.load() && !mAppliedQuality.load()){
+    QualitySettings* quality = mPendingQuality.exchange(NULL);
+    if(quality){
+      mQuality = *quality;
+      mTier = 0;
+      mLoadAvg = 0.;
+      mQualityChanged = true;
+      mAppliedQuality = quality;
+    }
+  }
+  std::chrono::steady_clock::time_point blockStart;
+  if(mQuality.autoTier)
+    blockStart = std::chrono::steady_clock::now();
+  long long faults = mStreaming ? ThreadMajorFaults() : 0;
+
+  if(mOffline){
+    waitSoundFont();
+    waitPresets();
+  }
+  if(mPendingTransform.load() && !mAppliedTransform.load()){
+    MidiTransform* transform = mPendingTransform.exchange(NULL);
+    if(transform){
+      mTransform = *transform; // plain copy
+      mTransformTables.compile(mTransform);
+      mAppliedTransform = transform;
+    }
+  }
+
+  // when fully bypassed, the synth is not called at all (parameters are still applied)
+  bool bypassed = mBypass && (mBypassPos >= mBypassLength);
+
+  // single walk over the block, rendering between changes. In case events have not fit
+  // into the schedule, the rest (with later parameter points) is walked again from the current position.
+  int32 count = 0;
+  int32 sample = 0;
+  bool silent = true;
+  for(int32 nextEvent = 0, fromOffset = -1; nextEvent >= 0; ){
+    int32 scheduled = buildSchedule(data, nextEvent, fromOffset);
+    for(int32 i = 0; i < scheduled; ++i){
+      ScheduledItem& item = mSchedule[i];
+      if((item.sampleOffset > sample) && !bypassed){
+	silent = writeAudio(data, sample, item.sampleOffset) && silent;
+	sample = item.sampleOffset;
+      }
+      if(item.isEvent)
+	playEvent(data, item.event);
+      else {
+	playParChange(data, item.id, item.value);
+	if(mOffline && (item.id >= kChPrgId) && (item.id <= kLastChPrgId))
+	  waitPresets();
+      }
+    }
+    count += scheduled;
+  }
+  if(bypassed){
+    checkSoundFont(); // let loaded font to be taken
+    silent = writeBypass(data);
+  } else {
+    if(sample < data.numSamples)
+      silent = writeAudio(data, sample, data.numSamples) && silent;
+    if(mBypass || (mBypassPos > 0))
+      silent = rampBypass(data) && silent;
+  }
+  if(mSynth && mQualityChanged.exchange(false))
+    applyQuality(mSynth);
+  if(mSynth && mQuality.autoTier && !mOffline)
+    updateAutoTier((int32)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - blockStart).count(), data.numSamples);
+  serveStateRequests();
+  serveLoadCapture();
+  if(mStreaming)
+    countUnderruns(data, ThreadMajorFaults() - faults);
+
+  // let the host know, all busses are zeroed in this case
+  for(int32 bus = 0; bus < data.numOutputs; ++bus)
+    data.outputs[bus].silenceFlags = silent ? ((uint64)1 << data.outputs[bus].numChannels) - 1 : 0;
+
+  if(mTelemetry.isTimed()){
+    TelemetryRecord& record = probe.record();
+    record.id = (isSoundFontLoaded() ? kTelFontLoaded : 0) | (mFadeSynth ? kTelFading : 0) | (mBypass ? kTelBypass : 0);
+    record.arg[0] = data.numSamples;
+    record.arg[1] = count;
+    record.arg[2] = fluid_synth_get_active_voice_count(mSynth);
+    record.arg[3] = mScheduleDropped;
+  }
+  return kResultOk;
+}
+
+// A block with major page faults has waited for the disk, most likely for streamed samples
+void Processor::countUnderruns(Vst::ProcessData& data, long long faults){
+  if(faults > 0){
+    ++mUnderruns;
+    TelemetryLog(mTelemetry, kTelUnderrun, (int32)faults, (int32)mUnderruns);
+  }
+  if((mUnderruns != mUnderrunsSent) && data.outputParameterChanges){
+    int32 index;
+    Vst::IParamValueQueue* queue = data.outputParameterChanges->addParameterData(kUnderrunsId, index);
+    if(queue && (queue->addPoint(0, (Vst::ParamValue)std::min(mUnderruns, (uint32)kMaxUnderruns) / kMaxUnderruns, index) == kResultOk))
+      mUnderrunsSent = mUnderruns;
+  }
+}
+
+// Bypass input, when there is stereo one with buffers
+static bool HasBypassInput(Vst::ProcessData& data){
+  if((data.numInputs < 1) || (data.inputs[0].numChannels < 2))
+    return false;
+  if(data.symbolicSampleSize == Vst::kSample32)
+    return data.inputs[0].channelBuffers32 && data.inputs[0].channelBuffers32[0] && data.inputs[0].channelBuffers32[1];
+  return data.inputs[0].channelBuffers64 && data.inputs[0].channelBuffers64[0] && data.inputs[0].channelBuffers64[1];
+}
+
+template<typename T>
+static void CopyBypass(T **in, T **out, int32 numSamples){
+  for(int32 c = 0; c < 2; ++c){
+    if(out[c] != in[c]) // hosts can process in place
+      memcpy(out[c], in[c], sizeof(T) * numSamples);
+  }
+}
+
+template<typename T>
+static void ZeroBypass(T **out, int32 numSamples){
+  memset(out[0], 0, sizeof(T) * numSamples);
+  memset(out[1], 0, sizeof(T) * numSamples);
+}
+
+// Fully bypassed: the input goes to the main output, all other are silent. Returns true when silent.
+bool Processor::writeBypass(Vst::ProcessData& data){
+  bool hasInput = HasBypassInput(data);
+  for(int32 bus = 0; bus < std::min(data.numOutputs, (int32)kMaxOutputBusses); ++bus){
+    if(!isOutputBusUsed(data, bus) || (data.outputs[bus].numChannels < 2))
+      continue;
+    if(data.symbolicSampleSize == Vst::kSample32){
+      if((bus == kMainBus) && hasInput)
+	CopyBypass(data.inputs[0].channelBuffers32, data.outputs[bus].channelBuffers32, data.numSamples);
+      else
+	ZeroBypass(data.outputs[bus].channelBuffers32, data.numSamples);
+    } else {
+      if((bus == kMainBus) && hasInput)
+	CopyBypass(data.inputs[0].channelBuffers64, data.outputs[bus].channelBuffers64, data.numSamples);
+      else
+	ZeroBypass(data.outputs[bus].channelBuffers64, data.numSamples);
+    }
+  }
+  return !hasInput || ((data.inputs[0].silenceFlags & 3) == 3);
+}
+
+/*
+ * Crossfade between the synth (pos = 0) and the input or silence (pos = length).
+ * With in place processing the input is already overwritten by the synth, so
+ * then it is just a fade of the synth.
+ */
+template<typename T>
+static int32 RampBypass(T **out, T **in, int32 numSamples, int32 pos, int32 length, bool bypass){
+  for(int32 i = 0; i < numSamples; ++i){
+    if(bypass){
+      if(pos < length)
+	++pos;
+    } else if(pos > 0)
+      --pos;
+    T gain = (T)(length - pos) / length;
+    for(int32 c = 0; c < 2; ++c){
+      out[c][i] *= gain;
+      if(in && (in[c] != out[c]))
+	out[c][i] += in[c][i] * (1 - gain);
+    }
+  }
+  return pos;
+}
+
+// Returns true when the result is silent
+bool Processor::rampBypass(Vst::ProcessData& data){
+  bool hasInput = HasBypassInput(data);
+  int32 pos = mBypassPos;
+  for(int32 bus = 0; bus < std::min(data.numOutputs, (int32)kMaxOutputBusses); ++bus){
+    if(!isOutputBusUsed(data, bus) || (data.outputs[bus].numChannels < 2))
+      continue;
+    if(data.symbolicSampleSize == Vst::kSample32)
+      pos = RampBypass(data.outputs[bus].channelBuffers32, ((bus == kMainBus) && hasInput) ? data.inputs[0].channelBuffers32 : (float **)NULL,
+		       data.numSamples, mBypassPos, mBypassLength, mBypass);
+    else
+      pos = RampBypass(data.outputs[bus].channelBuffers64, ((bus == kMainBus) && hasInput) ? data.inputs[0].channelBuffers64 : (double **)NULL,
+		       data.numSamples, mBypassPos, mBypassLength, mBypass);
+  }
+  mBypassPos = pos;
+  if(mBypass && (mBypassPos >= mBypassLength)){
+    // faded out, stop the voices so nothing is rendered till bypass is off
+    fluid_synth_all_sounds_off(mSynth, -1);
+    for(int32 ch = 0; ch < 16; ++ch)
+      mSynthState.allNotesOff(ch);
+  }
+  return false;
+}
+
+tresult PLUGIN_API Processor::setProcessing (TBool state){
+  mProcessing = state;
+  if(state){
+    //printf("Processor: started\n");
+  } else {
+    //printf("Processor: ended\n");
+  }
+  return kResultTrue;
+}
+
+/*
+ * Take loaded standby synth into use. With fade, the channel state is transferred
+ * from the current synth, held notes are started again and the current synth
+ * is faded out. Without fade, it is just retired.
+ * Should not be called while the previous fade is in progress.
+ */
+void Processor::adoptStandbySynth(bool fade){
+  fluid_synth_t* synth = mStandbySynth.exchange(NULL);
+  if(!synth)
+    return;
+  mLoadedGeneration = mStandbyGeneration;
+  mFontRelease = mStandbyRelease.load();
+  mIdle = false;
+  applyQuality(synth);
+  uint32 capture = mStandbyCapture;
+  if(mSynth){
+    mSynthState.captureFrom(mSynth);
+    if(capture && (capture == mLoadCapture)){
+      // the worker has replayed mLoadSnapshot
+      uint32 programChanged = mSynthState.applyChangesTo(synth, mLoadSnapshot);
+      for(int32 ch = 0; ch < 16; ++ch){
+	if((programChanged & (1 << ch)) &&
+	   ((mChannelLayers[ch] > 0) || (mSynthState.channels[ch].bank >= kLayerBankOffset)))
+	  selectProgram(synth, ch, mSynthState.channels[ch].program);
+      }
+    } else {
+      if(capture) // replayed some older capture
+	fluid_synth_system_reset(synth);
+      mSynthState.applyTo(synth);
+      selectLayers(synth, mSynthState);
+    }
+    if(fade && (mFadeLength > 0) && (fluid_synth_get_active_voice_count(mSynth) > 0)){
+      fluid_synth_all_notes_off(mSynth, -1); // let them release while fading
+      mFadeSynth = mSynth;
+      mFadePos = 0;
+    } else if(!retireSynth(mSynth)){
+      // should not happen, but we can not delete it here
+      mFadeSynth = mSynth;
+      mFadePos = mFadeLength;
+    }
+  }
+  mSynth = synth;
+}
+
+// Real time safe, return false when there is no free slot
+bool Processor::retireSynth(fluid_synth_t* synth){
+  for(auto& retired : mRetiredSynths){
+    fluid_synth_t* expected = NULL;
+    if(retired.compare_exchange_strong(expected, synth))
+      return true;
+  }
+  return false;
+}
+
+void Processor::deleteRetiredSynths(){
+  for(auto& retired : mRetiredSynths){
+    fluid_synth_t* synth = retired.exchange(NULL);
+    if(synth)
+      delete_fluid_synth(synth);
+  }
+}
+
+/*
+ * Returns true in case the synth can be used.
+ * Take loaded synth into use, when there is one.
+ *
+ * In hot swap mode the current synth can be used while the new font is loading.
+ *
+ * It is not thread safe, but it can be called from
+ * process only.
+ */
+bool Processor::checkSoundFont(){
+  //PerfMeter pm("Check", 8000);
+  if(mStandbySynth && !mFadeSynth)
+    adoptStandbySynth(mHotSwap);
+  return mHotSwap || (mLoadedGeneration == mRequestedGeneration);
+}
+
+/*
+ * Apply restored state and capture the snapshot for getState, from process.
+ * Both are rare (on project load and save), so the cost of touching all
+ * controllers is acceptable.
+ */
+void Processor::serveStateRequests(){
+  if(!mSynth || !isSoundFontLoaded())
+    return;
+  if(mPendingState.load() && !mAppliedState.load()){
+    SynthState* state = mPendingState.exchange(NULL);
+    if(state){
+      state->applyTo(mSynth); // held notes are not in the snapshot
+      resetCtrlValues();
+      selectLayers(mSynth, *state);
+      for(int ch = 0; ch < 16; ++ch){
+	mSynthState.channels[ch].pressure = state->channels[ch].pressure;
+	queuePrefetch(ch, state->channels[ch].bank, state->channels[ch].program);
+      }
+      mAppliedState = state;
+    }
+  }
+  int32 expected = kCaptureRequested;
+  if(mCaptureState.compare_exchange_strong(expected, kCaptureBusy)){
+    if(!mPendingState.load()) // otherwise the snapshot is already what should be saved
+      mSnapshot.captureFrom(mSynth);
+    for(int ch = 0; ch < 16; ++ch)
+      mSnapshot.channels[ch].pressure = mSynthState.channels[ch].pressure;
+    mCaptureState = kCaptureIdle;
+  }
+}
+
+/*
+ * Ask process to update mSnapshot, returns false when it was not done in time
+ * (processing is stopped). mSnapshot is the last known state then.
+ */
+bool Processor::captureSnapshot(){
+  if(!mProcessing)
+    return false;
+  mCaptureState = kCaptureRequested;
+  for(int32 ms = 0; ms < kStateCaptureWaitMs; ++ms){
+    if(mCaptureState == kCaptureIdle)
+      return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  int32 expected = kCaptureRequested;
+  if(mCaptureState.compare_exchange_strong(expected, kCaptureIdle))
+    return false;
+  while(mCaptureState != kCaptureIdle) // process is capturing just now
+    std::this_thread::yield();
+  return true;
+}
+
+/*
+ * Set current quality, lowered by the auto tier. Polyphony is automatable and is changed
+ * in process: synths are created with the maximum, so any value here does not allocate.
+ */
+void Processor::applyQuality(fluid_synth_t* synth){
+  static const int kInterpMethod[kInterpCount] = {
+    FLUID_INTERP_NONE, FLUID_INTERP_LINEAR, FLUID_INTERP_4THORDER, FLUID_INTERP_7THORDER
+  };
+  int32 interp = mQuality.interp;
+  int32 polyphony = mQuality.polyphony;
+  bool  chorus = mQuality.chorus;
+  if(mOffline){
+    interp = kInterp7th;
+    polyphony = kPolyphonyCount - 1;
+  } else if(mQuality.autoTier && (mTier > 0)){
+    // 1: linear interpolation, 2: and half of voices without chorus, 3: no interpolation and quarter of voices
+    interp = std::min<int32>(interp, (mTier >= 3) ? kInterpNone : kInterpLinear);
+    polyphony = std::max(0, polyphony - (mTier - 1));
+    chorus = chorus && (mTier < 2);
+  }
+  fluid_synth_set_interp_method(synth, -1, kInterpMethod[interp]);
+  fluid_synth_set_polyphony(synth, QualitySettings::voices(polyphony));
+  fluid_synth_set_reverb_on(synth, mQuality.reverb);
+  fluid_synth_set_chorus_on(synth, chorus);
+}
+
+// Voice rendering threads for the synth
+int32 Processor::cpuCores() const {
+  if(!mOffline)
+    return mCpuCores;
+  return std::max<int32>(mCpuCores, std::min<int32>(std::thread::hardware_concurrency(), kMaxCpuCores));
+}
+
+// Auto quality, from process with the time spent for the block
+void Processor::updateAutoTier(int32 blockUs, int32 numSamples){
+  double deadlineUs = numSamples * 1000000. / processSetup.sampleRate;
+  mLoadAvg += (blockUs / deadlineUs - mLoadAvg) * 0.1;
+  mTierHold -= numSamples;
+  if(mTierHold > 0)
+    return;
+  int32 tier = mTier;
+  if((mLoadAvg > kTierUpLoad) && (mTier < kMaxTier)){
+    ++mTier;
+    mTierHold = kTierUpHoldSec * processSetup.sampleRate;
+  } else if((mLoadAvg < kTierDownLoad) && (mTier > 0)){
+    --mTier;
+    mTierHold = kTierDownHoldSec * processSetup.sampleRate;
+  }
+  if(tier != mTier){
+    applyQuality(mSynth);
+    TelemetryLog(mTelemetry, kTelQualityTier, mTier);
+  }
+}
+
+/*
+ * Recreate the synth with current settings, the font and the channel state are kept.
+ * The font is already in the module cache, so that is fast. Should be called when
+ * processing is stopped, returns false when the current font is not (yet) loaded.
+ */
+bool Processor::rebuildSynth(){
+  if(!mSynth || !isSoundFontLoaded() || mStandbySynth.load())
+    return false;
+  std::string soundFontFile;
+  {
+    std::lock_guard<std::mutex> lock(mFontMutex);
+    if(mChangeSoundFont || !mSoundFontFile.text8()[0])
+      return false;
+    soundFontFile = mSoundFontFile.text8();
   }
-  return result;
+  fluid_synth_t* synth = newSynth();
+  if(!synth)
+    return false;
+  if(loadFonts(synth, soundFontFile.c_str(), NULL) == FLUID_FAILED){
+    delete_fluid_synth(synth);
+    return false;
+  }
+  mSynthState.captureFrom(mSynth);
+  mSynthState.applyTo(synth);
+  selectLayers(synth, mSynthState);
+  applyQuality(synth);
+  delete_fluid_synth(mSynth);
+  mSynth = synth;
+  if(mFadeSynth){ // was fading with the old rate
+    delete_fluid_synth(mFadeSynth);
+    mFadeSynth = NULL;
+  }
+  mIdle = false;
+  return true;
 }
 
-tresult PLUGIN_API Processor::setBusArrangements(Vst::SpeakerArrangement* inputs, int32 numIns,
-						 Vst::SpeakerArrangement* outputs, int32 numOuts){
-  if((numIns == 1) && (numOuts == 1) && (inputs[0] == outputs[0])){
-    return AudioEffect::setBusArrangements(inputs, numIns, outputs, numOuts);
-  }
-  return kResultFalse;
+// Let loader workers recreate the synth with current settings (and the current font from the cache),
+// real time safe
+void Processor::requestRebuild(){
+  ++mProcessRebuilds;
+  WakeSoundFontLoader();
 }
 
-tresult PLUGIN_API Processor::canProcessSampleSize(int32 symbolicSampleSize){
-  if(symbolicSampleSize == Vst::kSample32)
-    return kResultTrue;
-  // printf("64bit (%d) audio is not supported by now\n", symbolicSampleSize);
-  // Well, FluidSynth has compile time fixed precision. And it is default to 64bit... But
-  // fluid_synth_write_float unconditionally writes "float", so 32bit...
-  return kResultFalse;
+bool Processor::hasProcessRequest() const {
+  for(auto& soundFontIdx : mProcessLayerFonts){
+    if(soundFontIdx >= 0)
+      return true;
+  }
+  return (mProcessFontIdx >= 0) || (mProcessRebuilds != mTakenRebuilds);
 }
 
-tresult PLUGIN_API Processor::setupProcessing(Vst::ProcessSetup& setup){
-  tresult result = AudioEffect::setupProcessing(setup);
-  if(result == kResultTrue){
-    //printf("Processor: SetupProcessing\n");
-    // TODO: set block size, etc.
-    if(fluid_settings_setnum(mSynthSettings, "synth.sample-rate", setup.sampleRate) == FLUID_FAILED){
-      printf("Could not set sample rate to %f\n", setup.sampleRate);
+// For loader workers, process requests are converted to usual ones here
+void Processor::takeProcessRequest(){
+  int32 soundFontIdx = mProcessFontIdx;
+  uint32 rebuilds = mProcessRebuilds;
+  bool rebuild = (rebuilds != mTakenRebuilds);
+  int32 layerFontIdx[kMaxLayers - 1];
+  for(int32 layer = 1; layer < kMaxLayers; ++layer){
+    layerFontIdx[layer - 1] = mProcessLayerFonts[layer - 1];
+    if(layerFontIdx[layer - 1] < 0)
+      continue;
+    String fileName;
+    {
+      std::lock_guard<std::mutex> lock(mFontMutex);
+      if(layerFontIdx[layer - 1] <= (int32)mSoundFontFiles.size())
+	fileName = layerFontIdx[layer - 1] ? mSoundFontFiles.at(layerFontIdx[layer - 1] - 1) : String("");
+      else
+	continue;
     }
-    // BAD SDK:
-    //   from common sense, we should not load any sound font till we know which one should be loaded
-    //   but reality is different. REAPER calls setupProcessing before setState, even in case it is
-    //   called later (the plug-in is instantiated from a project, from saved state).
-    //   In case last getState returns the same as default getState, setState is not called at all.
-    //   Finally, if plug-in is just instantiated, setState should not be called. And so,
-    //   we have no way to check the user wants not default font in this instance, we are forced
-    //   to always load default first.
-    if(!mSoundFontFile.text8()[0]){
-      mSoundFontFile = mSoundFontFiles.at(getCurrentSoundFontIdx()); // we know the list is not emply
+    rebuild = setLayerFont(layer, fileName) || rebuild;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mFontMutex);
+    if((soundFontIdx >= 0) && (soundFontIdx < (int32)mSoundFontFiles.size()) &&
+       (mSoundFontFile != mSoundFontFiles.at(soundFontIdx))){
+      mSoundFontFile = mSoundFontFiles.at(soundFontIdx);
+      mChangeSoundFont = true;
+      //printf("Processor: will change font to %s\n", mSoundFontFile.text8());
+    } else if(rebuild && mSoundFontFile.text8()[0]) // when nothing is requested yet, the first request will use current settings
       mChangeSoundFont = true;
-    }
-    checkSoundFont(true);
-    /*
-    if((setup.sampleRate == Vst::kSample64) && (mAudioBufsSize < setup.maxSamplesPerBlock)){
-      // we should be called with real time stopped
-      if(mAudioBufs[0])
-	delete [] mAudioBufs[0];
-      if(mAudioBufs[1])
-	delete [] mAudioBufs[1];
-      mAudioBufs[0] = new float[setup.maxSamplesPerBlock + 1];
-      mAudioBufs[1] = new float[setup.maxSamplesPerBlock + 1];
-      if(mAudioBufs[0] && mAudioBufs[1])
-	mAudioBufsSize = setup.maxSamplesPerBlock;
-      else
-	mAudioBufsSize = 0;
-      }
-      */
   }
-  return result;
+  requestSoundFont();
+  mProcessFontIdx.compare_exchange_strong(soundFontIdx, -1); // a newer one stays
+  for(int32 layer = 1; layer < kMaxLayers; ++layer)
+    mProcessLayerFonts[layer - 1].compare_exchange_strong(layerFontIdx[layer - 1], -1);
+  mTakenRebuilds = rebuilds;
 }
 
-tresult PLUGIN_API Processor::setActive(TBool state){
-  tresult result = AudioEffect::setActive(state);
-  if(result == kResultTrue){
-    if(state){
-      //printf("Processor: activated\n");
-    } else {
-      //printf("Processor: deactivated\n");
-    }
+// Offline there is no deadline, so render with the requested font instead of the previous one (or silence)
+void Processor::waitSoundFont(){
+  for(int32 ms = 0; hasProcessRequest() && (ms < kOfflineLoadWaitMs); ++ms)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1)); // till workers take it
+  if(mWaitedGeneration == mRequestedGeneration)
+    return; // do not wait again for failed one
+  mWaitedGeneration = mRequestedGeneration;
+  for(int32 ms = 0; !isSoundFontLoaded() && (ms < kOfflineLoadWaitMs); ++ms){
+    serveLoadCapture(); // the worker waits for it
+    if(mStandbySynth && !mFadeSynth)
+      adoptStandbySynth(false);
+    else
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
   }
-  return result;
 }
 
-void Processor::writeAudio(Vst::ProcessData& data, int32 start_sample, int32 end_sample){ // end_sample is exclusive
-  if((data.numSamples < end_sample) || (start_sample >= end_sample) || (data.numOutputs < 1) || (data.outputs[0].numChannels < 2))
-    return;
+// Id of the font loaded for the layer, FLUID_FAILED when there is no such
+static int LayerSoundFontId(fluid_synth_t* synth, int32 layer){
+  for(int i = 0; i < fluid_synth_sfcount(synth); ++i){
+    int id = fluid_sfont_get_id(fluid_synth_get_sfont(synth, i));
+    if(fluid_synth_get_bank_offset(synth, id) == layer * kLayerBankOffset)
+      return id;
+  }
+  return FLUID_FAILED;
+}
 
-  if(data.symbolicSampleSize == Vst::kSample32){
-    if(!checkSoundFont(false)){
-      // the synth is not ready
-      memset(data.outputs[0].channelBuffers32[0] + start_sample, 0, sizeof(float) * (end_sample - start_sample));
-      memset(data.outputs[0].channelBuffers32[1] + start_sample, 0, sizeof(float) * (end_sample - start_sample));
-    } else {
-      if(fluid_synth_write_float(mSynth, end_sample - start_sample,
-				data.outputs[0].channelBuffers32[0] + start_sample, 0, 1,
-				data.outputs[0].channelBuffers32[1] + start_sample, 0, 1) == FLUID_FAILED){
-	//printf("Generation failed\n");
-      }
-    }
-  } else {
-    // MAYBE TODO: handle 64bit audio case
-    // fluid_synth_write_double does not exist (yet)
-    // I have started to add tmp buffer, but I think hosts can handle that limitation automatically
-  }
-}
-
-// A bit not optimal...
-
-// return earliest change/event sample offset after (strict) curSample (which can be -1)
-// return -1 in case there is no changes/event after curSample
-// Can it return offset greater or equal data.numSamples? I try to process that correctly, just in case...
-int32 Processor::nextOffset(Vst::ProcessData& data, int32 curSample){
-  int32 minSampleOffset = -1;
-  if(data.inputParameterChanges){
-    int32 numParamsChanged = data.inputParameterChanges->getParameterCount();
-    for(int32 index = 0; index < numParamsChanged; index++){
-      Vst::IParamValueQueue* paramQueue = data.inputParameterChanges->getParameterData(index);
-      if(paramQueue){
-	Vst::ParamValue value;
-	int32 sampleOffset;
-	int32 numPoints = paramQueue->getPointCount();
-	for(int32 point = 0; point < numPoints; ++point){
-	  if(paramQueue->getPoint(point, sampleOffset, value) == kResultTrue){
-	    if((minSampleOffset >= 0) && (sampleOffset > minSampleOffset))
-	      break; // assume they are time ordered
-	    if(sampleOffset > curSample)
-	      minSampleOffset = sampleOffset;
-	  }
-	}
-      }
-    }
+/*
+ * Program change within the channel layer. The bank is the channel one without the layer offset,
+ * channel 10 uses drum bank as FluidSynth does it. When the layer has no such preset (or the
+ * font), the channel plays the main font.
+ */
+void Processor::selectProgram(fluid_synth_t* synth, int32 ch, int32 program){
+  int32 layer = mChannelLayers[ch];
+  int sfontId, bank, currentProgram;
+  if(fluid_synth_get_program(synth, ch, &sfontId, &bank, &currentProgram) != FLUID_OK)
+    return;
+  if(layer > 0){
+    int id = LayerSoundFontId(synth, layer);
+    int layerBank = layer * kLayerBankOffset + ((ch == 9) ? 128 : bank % kLayerBankOffset);
+    if((id != FLUID_FAILED) && (fluid_synth_program_select(synth, ch, id, layerBank, program) == FLUID_OK))
+      return;
   }
-  Vst::Event e;
-  int32 evcount = data.inputEvents ? data.inputEvents->getEventCount() : 0;
-  for(int32 index = 0; index < evcount; ++index){
-    if(data.inputEvents->getEvent(index, e) == kResultTrue){
-      if((minSampleOffset >= 0) && (e.sampleOffset > minSampleOffset))
-	break; // assume they are time ordered
-      if(e.sampleOffset > curSample)
-	minSampleOffset = e.sampleOffset;
-    }
+  if(bank >= kLayerBankOffset)
+    fluid_synth_bank_select(synth, ch, bank % kLayerBankOffset);
+  fluid_synth_program_change(synth, ch, program);
+}
+
+// After the state is applied, channels of not main layers (or which were) select their presets again
+void Processor::selectLayers(fluid_synth_t* synth, const SynthState& state){
+  for(int32 ch = 0; ch < 16; ++ch){
+    if((mChannelLayers[ch] > 0) || (state.channels[ch].bank >= kLayerBankOffset))
+      selectProgram(synth, ch, state.channels[ch].program);
   }
-  return minSampleOffset;
 }
 
-void Processor::playParChanges(Vst::ProcessData& data, int32 curSample, int32 endSample){ // endSample inclusive
-  if(!data.inputParameterChanges)
+// Returns true when changed, the synth should be rebuilt to apply
+bool Processor::setLayerFont(int32 layer, const String& fileName){
+  std::lock_guard<std::mutex> lock(mLayersMutex);
+  if(mLayers.files[layer] == fileName.text8())
+    return false;
+  mLayers.files[layer] = fileName.text8();
+  return true;
+}
+
+// Offline with on demand loading, wait for samples of selected presets
+void Processor::waitPresets(){
+  if(!GetOptions().onDemand)
     return;
-  int32 numParamsChanged = data.inputParameterChanges->getParameterCount();
-  for(int32 index = 0; index < numParamsChanged; index++){
-    Vst::IParamValueQueue* paramQueue = data.inputParameterChanges->getParameterData(index);
-    if(paramQueue){
-      Vst::ParamValue value;
-      int32 sampleOffset;
-      Vst::ParamID id = paramQueue->getParameterId();
-      int32 numPoints = paramQueue->getPointCount();
-      for(int32 point = 0; point < numPoints; ++point){
-	if(paramQueue->getPoint(point, sampleOffset, value) == kResultTrue){
-	  if(sampleOffset < curSample)
-	    continue; // already played
-	  if(sampleOffset > endSample)
-	    break; // assume they are time ordered
-	  switch(id){
-	    case FluidSynthVSTParams::kBypassId:
-	      mBypass = (value > 0.5f);
-	      break;
-	    case FluidSynthVSTParams::kRootPrgId:
-	      // we can not change here, but we schedule the change on restart
-	      if(mSoundFontFiles.size()){
-		int32 soundFontIdx = (value*(mSoundFontFiles.size()-1) + 0.5);
-		//printf("Processor: font change request\n");
-		if(mSoundFontFile != mSoundFontFiles.at(soundFontIdx)){
-		  mSoundFontFile = mSoundFontFiles.at(soundFontIdx);
-		  mChangeSoundFont = true;
-		  //printf("Processor: will change font to %s\n", mSoundFontFile.text8());
-		  checkSoundFont(false);
-		}
-	      }
-	      break;
-	    default:
-	      if(!checkSoundFont(false)){
-		// the synth is not ready
-		break;
-	      }
-	      if(id >= 1024){
-		int32 ch = id / 1024 - 1;
-	        int32 ctrlNumber = id%1024;
-	        if(ctrlNumber < Vst::kAfterTouch){ // CC
-		  fluid_synth_cc(mSynth, ch, ctrlNumber, value*127.+0.5);
-		  //printf("Ch:%d CC%d = %d\n", ch, ctrlNumber, (int)(value*127. + 0.5));
-		} else if(ctrlNumber == Vst::kAfterTouch){
-		  fluid_synth_channel_pressure(mSynth, ch, value*127.+0.5);
-		  //printf("Ch:%d AT = %d\n", ch, (int)(value*127. + 0.5));
-		} else if(ctrlNumber == Vst::kPitchBend){
-		  fluid_synth_pitch_bend(mSynth, ch, value*16383.+0.5);
-		  //printf("Ch:%d PB = %d\n", ch, ((int)(value*16383. + 0.5)) - 8192);
-		} else {
-		  printf("Hmm... unknown control %d\n", ctrlNumber);
-		}
-	      } else if((id >= kChPrgId) && (id <= kLastChPrgId)){ // PC
-		fluid_synth_program_change(mSynth, id - kChPrgId, value*127.+0.5);
-	      } else {
-		printf("Unknown param change ID: %d\n", id);
-	      }
-	      // TODO: also send as "legacy MIDI events"
-	  }
-	}
-      }
-    }
-  }
+  for(int32 ms = 0; SharedPresetsLoading() && (ms < kOfflineLoadWaitMs); ++ms)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
 }
 
-void Processor::playEvents(Vst::ProcessData& data, int32 curSample, int32 endSample){ // endSample inclusive
-  Vst::Event e;
-  int32 evcount = data.inputEvents ? data.inputEvents->getEventCount() : 0;
-  for(int32 index = 0; index < evcount; ++index){
-    if(data.inputEvents->getEvent(index, e) == kResultTrue){
-      if(e.sampleOffset < curSample)
-	continue; // already played
-      if(e.sampleOffset > endSample)
-	break; // assume they are time ordered
-      switch(e.type){
-	case Vst::Event::kNoteOnEvent:
-	  if(fluid_synth_noteon(mSynth, e.noteOn.channel, e.noteOn.pitch, e.noteOn.velocity*127. + 0.5) == FLUID_FAILED){
-	    //printf("NoteOn failed\n");
-	  }
-	  break;
-	case Vst::Event::kNoteOffEvent:
-	  fluid_synth_noteoff(mSynth, e.noteOff.channel, e.noteOff.pitch);
-	  break;
-	default:
-	  // TODO: at least SysEx
-	  printf("Unprocessed Event type: %d\n", e.type);
-      }
-      if(data.outputEvents)
-        data.outputEvents->addEvent(e);
-    }
+// From process, the preset is prefetched by a loader worker
+void Processor::queuePrefetch(int32 ch, int32 bank, int32 program){
+  int32 preset = bank * 128 + program;
+  if(mChannelPresets[ch].exchange(preset, std::memory_order_relaxed) == preset)
+    return;
+  if(mPrefetchQueue.push(preset))
+    WakeSoundFontLoader();
+}
+
+// Loader worker
+void Processor::prefetchPresets(){
+  std::lock_guard<std::mutex> lock(mPrefetchMutex);
+  int32 preset;
+  while(mPrefetchQueue.pop(preset))
+    prefetchPreset(preset);
+}
+
+// Loader worker, the fonts are loaded into the standby synth (main font first, empty for no layer font)
+void Processor::prefetchFonts(const std::string (&paths)[kMaxLayers]){
+  std::lock_guard<std::mutex> lock(mPrefetchMutex);
+  if(!std::equal(std::begin(paths), std::end(paths), std::begin(mPrefetchPaths))){
+    unlockPresets(false);
+    std::copy(std::begin(paths), std::end(paths), std::begin(mPrefetchPaths));
   }
+  for(auto& preset : mChannelPresets)
+    prefetchPreset(preset);
 }
 
-tresult PLUGIN_API Processor::process(Vst::ProcessData& data){
-  //PerfMeter pm("Process", 8000);
-  //printf("*\n");
+/*
+ * With mPrefetchMutex locked. Banks of layer presets have the layer offset, their
+ * samples are in the layer font under the bank without it. NULL when there is no such font.
+ */
+const char* Processor::prefetchPath(int32 preset, int32& bank, int32& program) const {
+  bank = preset / 128;
+  program = preset % 128;
+  int32 layer = bank / kLayerBankOffset;
+  bank %= kLayerBankOffset;
+  if((layer >= kMaxLayers) || mPrefetchPaths[layer].empty())
+    return NULL;
+  return mPrefetchPaths[layer].c_str();
+}
 
-  if((data.numOutputs <= 0) || (data.numSamples <= 0))
-    return kResultOk;
+// With mPrefetchMutex locked
+void Processor::prefetchPreset(int32 preset){
+  int32 bank, program;
+  const char* path = prefetchPath(preset, bank, program);
+  if(!path)
+    return;
+  size_t size = PrefetchSharedPreset(path, bank, program, kPrefetchBudget, false);
+  int64 lockBudget = (int64)GetOptions().lockMb << 20;
+  if(!size || !lockBudget || (std::find_if(mLockedPresets.begin(), mLockedPresets.end(), [preset](const LockedPreset& locked){
+	  return locked.first == preset;
+	}) != mLockedPresets.end()))
+    return;
+  if(mLockedBytes + (int64)size > lockBudget)
+    unlockPresets(true);
+  if(mLockedBytes + (int64)size > lockBudget)
+    return;
+  PrefetchSharedPreset(path, bank, program, 0, true);
+  mLockedPresets.push_back(LockedPreset(preset, size));
+  mLockedBytes += size;
+  if(GetOptions().telemetry)
+    printf("Locked samples: %d KB\n", (int)(mLockedBytes / 1024));
+}
 
-  int32 curSample = -1;
-  while(true){
-    int32 offset = nextOffset(data, curSample);
-    int32 sample = (curSample < 0 ? 0 : curSample);
-    int32 endSample = data.numSamples;
-    if((offset >= 0) && (offset < endSample)){
-      // write before offset, which is withing the block
-      endSample = offset;
+// With mPrefetchMutex locked, all or not used by any channel
+void Processor::unlockPresets(bool unusedOnly){
+  for(auto it = mLockedPresets.begin(); it != mLockedPresets.end(); ){
+    int32 preset = it->first;
+    if(unusedOnly && (std::find(std::begin(mChannelPresets), std::end(mChannelPresets), preset) != std::end(mChannelPresets))){
+      ++it;
+      continue;
     }
-    if(endSample > sample)
-      writeAudio(data, sample, endSample);
-    if(offset >= 0){
-      playParChanges(data, curSample, endSample);
-      playEvents(data, curSample, endSample);
-    }
-    curSample = endSample;
-    if((curSample >= data.numSamples) && (offset < 0))
-      break;
+    int32 bank, program;
+    mLockedBytes -= it->second;
+    if(const char* path = prefetchPath(preset, bank, program)) // paths are not changed while locked
+      UnlockSharedPreset(path, bank, program);
+    it = mLockedPresets.erase(it);
   }
-  return kResultOk;
 }
 
-tresult PLUGIN_API Processor::setProcessing (TBool state){
-  if(state){
-    //printf("Processor: started\n");
-  } else {
-    //printf("Processor: ended\n");
-  }
-  return kResultTrue;
+// Ask loader workers to load mSoundFontFile, in case it was changed
+void Processor::requestSoundFont(bool isDefault){
+  std::lock_guard<std::mutex> lock(mFontMutex);
+  if(!mChangeSoundFont)
+    return;
+  //printf("Processor: changing sound font to %s\n", mSoundFontFile.text8());
+  mChangeSoundFont = false;
+  RequestSoundFont(this, mSoundFontFile.text8(), ++mRequestedGeneration, isDefault);
 }
 
 int Processor::getCurrentSoundFontIdx(){
   if(mSoundFontFiles.size() < 2)
     return 0;
+  std::lock_guard<std::mutex> lock(mFontMutex);
   auto it = std::find(mSoundFontFiles.begin(), mSoundFontFiles.end(), mSoundFontFile);
   if(it == mSoundFontFiles.end()){ // can be if not set or not exist, return default
     auto dit = std::find(mSoundFontFiles.begin(), mSoundFontFiles.end(), "default.sf2");
@@ -506,6 +2124,19 @@ float Processor::getCurrentSoundFontNormalized(){
   return (float)(getCurrentSoundFontIdx()) / (mSoundFontFiles.size() - 1);
 }
 
+// The list has "None" in front of the font names
+float Processor::getLayerFontNormalized(int32 layer){
+  String fileName;
+  {
+    std::lock_guard<std::mutex> lock(mLayersMutex);
+    fileName = mLayers.files[layer].c_str();
+  }
+  auto it = std::find(mSoundFontFiles.begin(), mSoundFontFiles.end(), fileName);
+  if(!fileName.text8()[0] || (it == mSoundFontFiles.end()))
+    return 0.;
+  return (float)(it - mSoundFontFiles.begin() + 1) / mSoundFontFiles.size();
+}
+
 
 tresult PLUGIN_API Processor::setState(IBStream* state){
   if(!state)
@@ -533,20 +2164,98 @@ tresult PLUGIN_API Processor::setState(IBStream* state){
   }
   if(!newSoundFontFile.text8()[0])
     newSoundFontFile = mSoundFontFiles.at(getCurrentSoundFontIdx()); // the list is not empty after scanning
-  if(newSoundFontFile != mSoundFontFile){
-    mSoundFontFile = newSoundFontFile;
-    auto it = std::find(mSoundFontFiles.begin(), mSoundFontFiles.end(), mSoundFontFile);
-    if(it == mSoundFontFiles.end()){
-      mSoundFontFiles.push_back( mSoundFontFile ); // some not existing sound font, add it
-      std::sort(mSoundFontFiles.begin(), mSoundFontFiles.end());
-      sendProgramList();
+
+  // older versions have not saved threading
+  int32 cpuCores = 1, threadPrio = kDefaultThreadPrio;
+  if(streamer.readInt32(cpuCores))
+    streamer.readInt32(threadPrio);
+  bool threadingChanged = setThreading(cpuCores, threadPrio);
+
+  // older versions have not saved the channel state
+  LayerSettings layers; // and layers, so none
+  MidiTransform transform; // and transform, so defaults
+  SynthState* restoredState = new SynthState();
+  if(!restoredState->read(streamer)){
+    delete restoredState;
+    restoredState = NULL;
+  } else {
+    QualitySettings quality;
+    if(quality.read(streamer)){
+      threadingChanged = threadingChanged || (quality.stealing != mStealing.exchange(quality.stealing)); // also on creation
+      // process owns mQuality
+      delete mAppliedQuality.exchange(NULL);
+      delete mPendingQuality.exchange(new QualitySettings(quality));
+      if(layers.read(streamer))
+	transform.read(streamer);
+    }
+  }
+  // process owns mTransform
+  delete mAppliedTransform.exchange(NULL);
+  delete mPendingTransform.exchange(new MidiTransform(transform));
+
+  // not existing sound fonts are added to the list
+  bool listChanged = false;
+  auto addSoundFontFile = [this, &listChanged](const String& fileName){
+    std::lock_guard<std::mutex> lock(mFontMutex);
+    auto it = std::lower_bound(mSoundFontFiles.begin(), mSoundFontFiles.end(), fileName);
+    if((it == mSoundFontFiles.end()) || (*it != fileName)){
+      mSoundFontFiles.insert(it, fileName);
+      listChanged = true;
     }
-    mChangeSoundFont = true;
+  };
+  bool layersChanged = false;
+  for(int32 layer = 1; layer < kMaxLayers; ++layer){
+    String fileName(layers.files[layer].c_str());
+    if(fileName.text8()[0])
+      addSoundFontFile(fileName);
+    layersChanged = setLayerFont(layer, fileName) || layersChanged;
+  }
+  for(int32 ch = 0; ch < 16; ++ch)
+    mChannelLayers[ch] = layers.channels[ch];
+
+  bool fontChanged;
+  {
+    std::lock_guard<std::mutex> lock(mFontMutex);
+    fontChanged = (newSoundFontFile != mSoundFontFile);
+    if(fontChanged){
+      mSoundFontFile = newSoundFontFile;
+      mChangeSoundFont = true;
+    }
+  }
+  if(fontChanged)
+    addSoundFontFile(newSoundFontFile);
+  if(listChanged)
+    sendProgramList();
+  if(fontChanged)
+    requestSoundFont();
+  else if(threadingChanged || layersChanged)
+    requestRebuild();
+  if(fontChanged || layersChanged)
     sendCurrentProgram();
+  if(restoredState){
+    if(fontChanged){ // the loader prefetches for the new font, otherwise process queues changed presets
+      for(int32 ch = 0; ch < 16; ++ch)
+	mChannelPresets[ch] = restoredState->channels[ch].bank * 128 + restoredState->channels[ch].program;
+    }
+    // after the font request, so process applies it to the new font
+    mSnapshot = *restoredState;
+    delete mAppliedState.exchange(NULL);
+    delete mPendingState.exchange(restoredState);
   }
   return kResultOk;
 }
 
+// Returns true when changed, the synth should be recreated to apply
+bool Processor::setThreading(int32 cpuCores, int32 threadPrio){
+  cpuCores = std::max(1, std::min(cpuCores, kMaxCpuCores));
+  threadPrio = std::max(0, std::min(threadPrio, kMaxThreadPrio));
+  if((cpuCores == mCpuCores) && (threadPrio == mThreadPrio))
+    return false;
+  mCpuCores = cpuCores;
+  mThreadPrio = threadPrio;
+  return true;
+}
+
 tresult PLUGIN_API Processor::getState(IBStream* state){
   int32 toSaveBypass = mBypass ? 1 : 0;
 
@@ -554,7 +2263,25 @@ tresult PLUGIN_API Processor::getState(IBStream* state){
 
   IBStreamer streamer(state, kLittleEndian);
   streamer.writeInt32(toSaveBypass);
-  streamer.writeStr8(mSoundFontFile.text8()); // can be empty
+  {
+    std::lock_guard<std::mutex> lock(mFontMutex);
+    streamer.writeStr8(mSoundFontFile.text8()); // can be empty
+  }
+  streamer.writeInt32(mCpuCores);
+  streamer.writeInt32(mThreadPrio);
+  captureSnapshot();
+  mSnapshot.write(streamer);
+  QualitySettings* pendingQuality = mPendingQuality.load(); // not deleted till the next setState
+  (pendingQuality ? *pendingQuality : mQuality).write(streamer);
+  {
+    std::lock_guard<std::mutex> lock(mLayersMutex);
+    LayerSettings layers = mLayers;
+    for(int32 ch = 0; ch < 16; ++ch)
+      layers.channels[ch] = mChannelLayers[ch];
+    layers.write(streamer);
+  }
+  MidiTransform* pendingTransform = mPendingTransform.load(); // not deleted till the next setState
+  (pendingTransform ? *pendingTransform : mTransform).write(streamer);
   //printf("   Current sound font: %s\n", mSoundFontFile.text8());
 
   // in case there will be no future setState, controller will be called with this state
@@ -564,6 +2291,42 @@ tresult PLUGIN_API Processor::getState(IBStream* state){
   return kResultOk;
 }
 
+/*
+ * Merge the shared SoundFont index into the instance list, returns true when the
+ * list is changed. Names are never removed: there is no way to shrink the program
+ * list in the controller, and the font can be in use or come back.
+ */
+bool Processor::scanSoundFonts(){
+  std::vector<std::string> names;
+  uint32 generation = GetSoundFontNames(names);
+  if(generation == mSoundFontIndexGeneration)
+    return false;
+  mSoundFontIndexGeneration = generation;
+  bool changed = false;
+  std::lock_guard<std::mutex> lock(mFontMutex);
+  for(auto const& name : names){
+    String soundFont(name.c_str());
+    auto it = std::lower_bound(mSoundFontFiles.begin(), mSoundFontFiles.end(), soundFont);
+    if((it == mSoundFontFiles.end()) || (*it != soundFont)){
+      mSoundFontFiles.insert(it, soundFont);
+      changed = true;
+    }
+  }
+  if(mSoundFontFiles.size() == 0){
+    mSoundFontFiles.push_back( "default.sf2" );
+    changed = true;
+  }
+  return changed;
+}
+
+// Should be called when processing is stopped, the list is used by process
+void Processor::refreshSoundFonts(){
+  if(scanSoundFonts()){
+    sendProgramList();
+    sendCurrentProgram();
+  }
+}
+
 void Processor::sendProgramList(){
   Steinberg::Buffer buf;
   for(auto const& fileName : mSoundFontFiles){
@@ -592,11 +2355,15 @@ tresult PLUGIN_API Processor::connect (IConnectionPoint* other){
 
 void Processor::sendCurrentProgram(){
   float cSoundFontNorm = getCurrentSoundFontNormalized();
+  float layersNorm[kMaxLayers - 1];
+  for(int32 layer = 1; layer < kMaxLayers; ++layer)
+    layersNorm[layer - 1] = getLayerFontNormalized(layer);
   Vst::IMessage* message = allocateMessage();
   FReleaser msgReleaser(message);
   if(message){
     message->setMessageID("CurrentSoundFont");
     message->getAttributes()->setBinary("Value", &cSoundFontNorm, sizeof(float));
+    message->getAttributes()->setBinary("Layers", layersNorm, sizeof(layersNorm));
     sendMessage(message);
   }
 }
@@ -604,6 +2371,61 @@ void Processor::sendCurrentProgram(){
 // Controller
 
 
+// Program change parameter of a channel, behaves as StringListParameter with "Prog N" strings
+class ChannelProgramParameter : public Vst::Parameter {
+  public:
+    ChannelProgramParameter(const Vst::TChar* title, Vst::ParamID tag, Vst::UnitID unitId) :
+      Vst::Parameter(title, tag, nullptr, 0., 127, Vst::ParameterInfo::kIsList | Vst::ParameterInfo::kIsProgramChange, unitId) {}
+
+    void toString(Vst::ParamValue valueNormalized, Vst::String128 string) const SMTG_OVERRIDE {
+      char name[32];
+      snprintf(name, sizeof(name), "Prog %d", (int32)toPlain(valueNormalized));
+      UString(string, str16BufferSize(Vst::String128)).fromAscii(name);
+    }
+    bool fromString(const Vst::TChar* string, Vst::ParamValue& valueNormalized) const SMTG_OVERRIDE {
+      String str(string);
+      int32 program;
+      if((sscanf(str.text8(), "Prog %d", &program) != 1) || (program < 0) || (program > 127))
+	return false;
+      valueNormalized = toNormalized(program);
+      return true;
+    }
+    Vst::ParamValue toPlain(Vst::ParamValue valueNormalized) const SMTG_OVERRIDE {
+      return std::min<Vst::ParamValue>(info.stepCount, valueNormalized * (info.stepCount + 1));
+    }
+    Vst::ParamValue toNormalized(Vst::ParamValue plainValue) const SMTG_OVERRIDE {
+      return plainValue / info.stepCount;
+    }
+};
+
+ChannelProgramList::ChannelProgramList(const Vst::String128 name, Vst::ProgramListID listId, Vst::UnitID unitId) :
+  Vst::ProgramList(name, listId, unitId) {
+  info.programCount = 128;
+}
+
+tresult ChannelProgramList::getProgramName(int32 programIndex, Vst::String128 name){
+  if((programIndex < 0) || (programIndex >= info.programCount))
+    return kResultFalse;
+  char title[32];
+  snprintf(title, sizeof(title), "Prog %d", programIndex);
+  UString(name, str16BufferSize(Vst::String128)).fromAscii(title);
+  return kResultTrue;
+}
+
+tresult ChannelProgramList::getProgramInfo(int32 programIndex, Vst::CString attributeId, Vst::String128 value){
+  return kResultFalse; // no attributes
+}
+
+tresult ChannelProgramList::setProgramName(int32 programIndex, const Vst::String128 name){
+  return kResultFalse; // fixed
+}
+
+Vst::Parameter* ChannelProgramList::getParameter(){
+  if(!parameter)
+    parameter = owned(new ChannelProgramParameter(info.name, info.id, unitId)); // IPtr takes the reference
+  return parameter;
+}
+
 tresult PLUGIN_API Controller::initialize(FUnknown* context){
   tresult result = EditController::initialize(context);
   if(result != kResultOk){
@@ -626,6 +2448,118 @@ tresult PLUGIN_API Controller::initialize(FUnknown* context){
   prgParam->getInfo().flags &= ~Vst::ParameterInfo::kCanAutomate;
   parameters.addParameter(prgParam);
 
+  // not automatable, the synth is recreated on change
+  // shown as the number of threads, 1..kMaxCpuCores
+  parameters.addParameter(new Vst::RangeParameter(STR16("Voice threads"), FluidSynthVSTParams::kCpuCoresId, nullptr,
+						  1, kMaxCpuCores, 1, kMaxCpuCores - 1, Vst::ParameterInfo::kNoFlags));
+  parameters.addParameter(STR16("Voice threads priority"), nullptr, kMaxThreadPrio, (double)kDefaultThreadPrio / kMaxThreadPrio,
+			  Vst::ParameterInfo::kNoFlags, FluidSynthVSTParams::kThreadPrioId);
+
+  // quality and CPU use
+  QualitySettings quality; // defaults
+  Vst::StringListParameter* listParam = new Vst::StringListParameter(STR16("Interpolation"), FluidSynthVSTParams::kInterpId);
+  listParam->appendString(STR16("None"));
+  listParam->appendString(STR16("Linear"));
+  listParam->appendString(STR16("4th order"));
+  listParam->appendString(STR16("7th order"));
+  listParam->getInfo().defaultNormalizedValue = ListValue(quality.interp, kInterpCount);
+  listParam->setNormalized(listParam->getInfo().defaultNormalizedValue);
+  parameters.addParameter(listParam);
+  listParam = new Vst::StringListParameter(STR16("Polyphony"), FluidSynthVSTParams::kPolyphonyId);
+  for(int32 i = 0; i < kPolyphonyCount; ++i){
+    String voices;
+    voices.printf("%d", QualitySettings::voices(i));
+    listParam->appendString(voices);
+  }
+  listParam->getInfo().defaultNormalizedValue = ListValue(quality.polyphony, kPolyphonyCount);
+  listParam->setNormalized(listParam->getInfo().defaultNormalizedValue);
+  parameters.addParameter(listParam);
+  parameters.addParameter(STR16("Reverb"), nullptr, 1, 1,
+			  Vst::ParameterInfo::kCanAutomate, FluidSynthVSTParams::kReverbOnId);
+  parameters.addParameter(STR16("Chorus"), nullptr, 1, 1,
+			  Vst::ParameterInfo::kCanAutomate, FluidSynthVSTParams::kChorusOnId);
+  // not automatable, the synth is recreated on change
+  listParam = new Vst::StringListParameter(STR16("Voice stealing"), FluidSynthVSTParams::kStealingId, nullptr,
+					   Vst::ParameterInfo::kIsList);
+  listParam->appendString(STR16("Default"));
+  listParam->appendString(STR16("Oldest"));
+  listParam->appendString(STR16("Quietest"));
+  parameters.addParameter(listParam);
+  parameters.addParameter(STR16("Auto quality"), nullptr, 1, 0,
+			  Vst::ParameterInfo::kCanAutomate, FluidSynthVSTParams::kAutoQualityId);
+
+  // layers, not automatable (fonts are loaded into a new synth). Font names are set as for the main font
+  for(int32 layer = 1; layer < kMaxLayers; ++layer){
+    String title;
+    title.printf("Sound Font %d", layer + 1);
+    listParam = new Vst::StringListParameter(title, FluidSynthVSTParams::kLayerFontId + layer - 1, nullptr,
+					     Vst::ParameterInfo::kIsList);
+    listParam->appendString(STR16("None"));
+    parameters.addParameter(listParam);
+    mCurrentLayers[layer - 1] = 0.;
+  }
+  // updated by the processor when streaming
+  parameters.addParameter(new Vst::RangeParameter(STR16("Stream underruns"), FluidSynthVSTParams::kUnderrunsId, nullptr,
+						  0, kMaxUnderruns, 0, kMaxUnderruns, Vst::ParameterInfo::kIsReadOnly));
+
+  // channel layers are in channel units, but before channel program parameters (see getParameterInfo)
+  for(int32 ch = 0; ch < 16; ++ch){
+    String title;
+    title.printf("Ch%d Sound Font", ch + 1);
+    listParam = new Vst::StringListParameter(title, FluidSynthVSTParams::kChLayerId + ch, nullptr,
+					     Vst::ParameterInfo::kIsList, ch + 1);
+    for(int32 layer = 0; layer < kMaxLayers; ++layer){
+      String layerName;
+      layerName.printf("Sound Font %d", layer + 1);
+      listParam->appendString(layerName);
+    }
+    parameters.addParameter(listParam);
+  }
+  // MIDI transform, in channel units too
+  MidiTransform transform; // defaults
+  for(int32 ch = 0; ch < 16; ++ch){
+    Vst::UnitID unitId = ch + 1;
+    String title;
+    title.printf("Ch%d Velocity curve", ch + 1);
+    listParam = new Vst::StringListParameter(title, FluidSynthVSTParams::kChVelocityId + ch, nullptr,
+					     Vst::ParameterInfo::kCanAutomate | Vst::ParameterInfo::kIsList, unitId);
+    listParam->appendString(STR16("Linear"));
+    listParam->appendString(STR16("Soft"));
+    listParam->appendString(STR16("Hard"));
+    listParam->appendString(STR16("Fixed"));
+    parameters.addParameter(listParam);
+    title.printf("Ch%d Transpose", ch + 1);
+    parameters.addParameter(new Vst::RangeParameter(title, FluidSynthVSTParams::kChTransposeId + ch, nullptr,
+						    -kMaxTranspose, kMaxTranspose, 0, 2 * kMaxTranspose,
+						    Vst::ParameterInfo::kCanAutomate, unitId));
+    title.printf("Ch%d Lowest key", ch + 1);
+    parameters.addParameter(new Vst::RangeParameter(title, FluidSynthVSTParams::kChKeyLowId + ch, nullptr,
+						    0, 127, transform.channels[ch].keyLow, 127,
+						    Vst::ParameterInfo::kCanAutomate, unitId));
+    title.printf("Ch%d Highest key", ch + 1);
+    parameters.addParameter(new Vst::RangeParameter(title, FluidSynthVSTParams::kChKeyHighId + ch, nullptr,
+						    0, 127, transform.channels[ch].keyHigh, 127,
+						    Vst::ParameterInfo::kCanAutomate, unitId));
+    title.printf("Ch%d Output channel", ch + 1);
+    listParam = new Vst::StringListParameter(title, FluidSynthVSTParams::kChOutputId + ch, nullptr,
+					     Vst::ParameterInfo::kCanAutomate | Vst::ParameterInfo::kIsList, unitId);
+    for(int32 output = 0; output < 16; ++output){
+      String outputName;
+      outputName.printf("Ch%d", output + 1);
+      listParam->appendString(outputName);
+    }
+    listParam->getInfo().defaultNormalizedValue = ListValue(transform.channels[ch].channel, 16);
+    listParam->setNormalized(listParam->getInfo().defaultNormalizedValue);
+    parameters.addParameter(listParam);
+    title.printf("Ch%d Events", ch + 1);
+    listParam = new Vst::StringListParameter(title, FluidSynthVSTParams::kChEventsId + ch, nullptr,
+					     Vst::ParameterInfo::kCanAutomate | Vst::ParameterInfo::kIsList, unitId);
+    listParam->appendString(STR16("All"));
+    listParam->appendString(STR16("Notes only"));
+    listParam->appendString(STR16("Controllers only"));
+    listParam->appendString(STR16("None"));
+    parameters.addParameter(listParam);
+  }
 
   for(int32 ch = 0; ch < 16; ++ch){
     Vst::UnitID unitId = ch + 1;
@@ -634,19 +2568,13 @@ tresult PLUGIN_API Controller::initialize(FUnknown* context){
     // Unit
     unitName.printf("Ch%d", ch + 1);
     addUnit(new Vst::Unit(unitName, unitId, Vst::kRootUnitId, prgListId /* Vst::kNoProgramListId */));
-    // ProgramList
+    // ProgramList, "Prog N" names are generated on request
     String listName;
     listName.printf("Ch%d", ch + 1);
-    Vst::ProgramList* prgList = new Vst::ProgramList(listName, prgListId, unitId);
+    Vst::ProgramList* prgList = new ChannelProgramList(listName, prgListId, unitId);
     addProgramList(prgList);
-    for(int32 i = 0; i < 128; i++){
-      String title;
-      title.printf("Prog %d", i);
-      prgList->addProgram(title);
-    }
     // ProgramList parameter
     Vst::Parameter* prgParam = prgList->getParameter();
-    prgParam->getInfo().flags &= ~Vst::ParameterInfo::kCanAutomate;
     parameters.addParameter(prgParam);
     /*
     unitName.printf("Prg Ch%d", ch + 1);
@@ -655,24 +2583,85 @@ tresult PLUGIN_API Controller::initialize(FUnknown* context){
                     prgListId, unitId);
 		    */
 
-    // CC, (Channel) AfterTouch, PitchBend
-    for(int midiCtrlNumber = 0; midiCtrlNumber < Vst::kCountCtrlNumber; ++midiCtrlNumber){
-      String parName;
-      int nSteps;
-      if(!szCCName[midiCtrlNumber][0])
-	continue;
-      parName.printf("Ch:%d %s", ch + 1, szCCName[midiCtrlNumber]);
-      if(midiCtrlNumber ==Vst::kPitchBend){
-	nSteps = 128*128 - 1; // 16383
-      } else {
-	nSteps = 127;
-      }
-      parameters.addParameter(parName, nullptr, nSteps, 0, Vst::ParameterInfo::kNoFlags, 1024 + 1024*ch + midiCtrlNumber);
-    }
+    // CC, (Channel) AfterTouch, PitchBend are virtual, see getParameterInfo
+  }
+  mNumParameters = parameters.getParameterCount();
+  for(auto& values : mCCValues){
+    for(auto& value : values)
+      value = 0.;
   }
   return kResultOk;
 }
 
+/*
+ * Host visible parameter order is the same as it was with all parameters registered:
+ * common parameters, then for each channel its program parameter followed by
+ * its CC parameters.
+ */
+int32 PLUGIN_API Controller::getParameterCount(){
+  return mNumParameters + 16*kCCParams.count;
+}
+
+tresult PLUGIN_API Controller::getParameterInfo(int32 paramIndex, Vst::ParameterInfo& info){
+  int32 numCommon = mNumParameters - 16; // before the first channel
+  if((paramIndex < numCommon) || (paramIndex >= getParameterCount()))
+    return EditControllerEx1::getParameterInfo(paramIndex, info);
+  int32 ch = (paramIndex - numCommon) / (1 + kCCParams.count);
+  int32 idx = (paramIndex - numCommon) % (1 + kCCParams.count);
+  if(idx == 0)
+    return EditControllerEx1::getParameterInfo(numCommon + ch, info); // program
+  int32 ctrlNumber = kCCParams.ctrlNumber[idx - 1];
+  char title[128];
+  snprintf(title, sizeof(title), "Ch:%d %s", ch + 1, szCCName[ctrlNumber]);
+  info.id = CCParamId(ch, ctrlNumber);
+  UString(info.title, str16BufferSize(Vst::String128)).fromAscii(title);
+  info.shortTitle[0] = 0;
+  info.units[0] = 0;
+  info.stepCount = (ctrlNumber == Vst::kPitchBend) ? 128*128 - 1 : 127;
+  info.defaultNormalizedValue = 0.;
+  info.unitId = Vst::kRootUnitId;
+  info.flags = Vst::ParameterInfo::kNoFlags;
+  return kResultTrue;
+}
+
+// CC parameters are plain normalized values, as Parameter does it by default
+tresult PLUGIN_API Controller::getParamStringByValue(Vst::ParamID tag, Vst::ParamValue valueNormalized, Vst::String128 string){
+  int32 ch, ctrlNumber;
+  if(!IsCCParam(tag, ch, ctrlNumber))
+    return EditControllerEx1::getParamStringByValue(tag, valueNormalized, string);
+  if(!UString(string, str16BufferSize(Vst::String128)).printFloat(valueNormalized, 4))
+    string[0] = 0;
+  return kResultTrue;
+}
+
+tresult PLUGIN_API Controller::getParamValueByString(Vst::ParamID tag, Vst::TChar* string, Vst::ParamValue& valueNormalized){
+  int32 ch, ctrlNumber;
+  if(!IsCCParam(tag, ch, ctrlNumber))
+    return EditControllerEx1::getParamValueByString(tag, string, valueNormalized);
+  return UString(string, 128).scanFloat(valueNormalized) ? kResultTrue : kResultFalse;
+}
+
+Vst::ParamValue PLUGIN_API Controller::normalizedParamToPlain(Vst::ParamID tag, Vst::ParamValue valueNormalized){
+  int32 ch, ctrlNumber;
+  if(!IsCCParam(tag, ch, ctrlNumber))
+    return EditControllerEx1::normalizedParamToPlain(tag, valueNormalized);
+  return valueNormalized;
+}
+
+Vst::ParamValue PLUGIN_API Controller::plainParamToNormalized(Vst::ParamID tag, Vst::ParamValue plainValue){
+  int32 ch, ctrlNumber;
+  if(!IsCCParam(tag, ch, ctrlNumber))
+    return EditControllerEx1::plainParamToNormalized(tag, plainValue);
+  return plainValue;
+}
+
+Vst::ParamValue PLUGIN_API Controller::getParamNormalized(Vst::ParamID tag){
+  int32 ch, ctrlNumber;
+  if(!IsCCParam(tag, ch, ctrlNumber))
+    return EditControllerEx1::getParamNormalized(tag);
+  return mCCValues[ch][ctrlNumber];
+}
+
 tresult PLUGIN_API Controller::notify (Vst::IMessage* message){
   if(!message)
     return kInvalidArgument;
@@ -688,7 +2677,7 @@ tresult PLUGIN_API Controller::notify (Vst::IMessage* message){
 	auto prgList = getProgramList(kRootPrgId);
 	auto prgPar  = dynamic_cast<Vst::StringListParameter *>(prgList->getParameter());
 	if(prgList && prgPar){
-	  const char *messageEnd = messageData + messageSize;
+	  const char *messageStart = messageData, *messageEnd = messageData + messageSize;
 	  // BAD SDK: there is no call to clear the list, so we can only replace...
 	  int32 currentProgramCount = prgList->getCount();
 	  int idx = 0;
@@ -707,6 +2696,22 @@ tresult PLUGIN_API Controller::notify (Vst::IMessage* message){
 	    messageData += strlen(messageData) + 1;
 	    ++idx;
 	  }
+	  // layer lists are the same, after "None"
+	  for(int32 layer = 1; layer < kMaxLayers; ++layer){
+	    auto layerPar = dynamic_cast<Vst::StringListParameter *>(getParameterObject(kLayerFontId + layer - 1));
+	    if(!layerPar)
+	      continue;
+	    const char *name = messageStart;
+	    for(int32 i = 1; name < messageEnd; ++i){
+	      String soundFont;
+	      soundFont.fromUTF8(name);
+	      if(i > layerPar->getInfo().stepCount)
+		layerPar->appendString(soundFont);
+	      else
+		layerPar->replaceString(i, soundFont);
+	      name += strlen(name) + 1;
+	    }
+	  }
 	  // TODO: set current value for parameter
 	  if(componentHandler)
 	    componentHandler->restartComponent(Vst::kParamValuesChanged);
@@ -721,6 +2726,9 @@ tresult PLUGIN_API Controller::notify (Vst::IMessage* message){
       // that should be an array of UTF8 strings
       if(messageData && (messageSize == sizeof(float))){
 	memcpy(&mCurrentProgram, messageData, sizeof(float));
+	if((message->getAttributes()->getBinary("Layers", (const void *&)messageData, messageSize) == kResultOk) &&
+	   messageData && (messageSize == sizeof(mCurrentLayers)))
+	  memcpy(mCurrentLayers, messageData, sizeof(mCurrentLayers));
 	// processor has precalculate correct value for us, but we do not setNormalized here
 	// it can be just initial value and there will be more
 	return kResultTrue;
@@ -749,6 +2757,53 @@ tresult PLUGIN_API Controller::setComponentState(IBStream* state){
     delete soundFontFileName;
   }
   setParamNormalized(kRootPrgId, mCurrentProgram);
+
+  int32 cpuCores = 1, threadPrio = kDefaultThreadPrio;
+  if(streamer.readInt32(cpuCores))
+    streamer.readInt32(threadPrio);
+  cpuCores = std::max(1, std::min(cpuCores, kMaxCpuCores));
+  threadPrio = std::max(0, std::min(threadPrio, kMaxThreadPrio));
+  setParamNormalized(kCpuCoresId, (double)(cpuCores - 1) / (kMaxCpuCores - 1));
+  setParamNormalized(kThreadPrioId, (double)threadPrio / kMaxThreadPrio);
+
+  SynthState synthState;
+  LayerSettings layers;
+  MidiTransform transform;
+  if(synthState.read(streamer)){
+    for(int32 ch = 0; ch < 16; ++ch){
+      const ChannelState& chState = synthState.channels[ch];
+      setParamNormalized(kChPrgId + ch, chState.program / 127.);
+      for(int32 ctrl = 0; ctrl < Vst::kAfterTouch; ++ctrl)
+	mCCValues[ch][ctrl] = chState.cc[ctrl] / 127.;
+      mCCValues[ch][Vst::kAfterTouch] = chState.pressure / 127.;
+      mCCValues[ch][Vst::kPitchBend] = chState.pitchBend / 16383.;
+    }
+    QualitySettings quality;
+    if(quality.read(streamer)){
+      setParamNormalized(kInterpId, ListValue(quality.interp, kInterpCount));
+      setParamNormalized(kPolyphonyId, ListValue(quality.polyphony, kPolyphonyCount));
+      setParamNormalized(kStealingId, ListValue(quality.stealing, kStealCount));
+      setParamNormalized(kReverbOnId, quality.reverb ? 1 : 0);
+      setParamNormalized(kChorusOnId, quality.chorus ? 1 : 0);
+      setParamNormalized(kAutoQualityId, quality.autoTier ? 1 : 0);
+      if(layers.read(streamer))
+	transform.read(streamer);
+    }
+  }
+  // layer file names are not used, the processor has sent their list positions
+  for(int32 layer = 1; layer < kMaxLayers; ++layer)
+    setParamNormalized(kLayerFontId + layer - 1, mCurrentLayers[layer - 1]);
+  for(int32 ch = 0; ch < 16; ++ch)
+    setParamNormalized(kChLayerId + ch, ListValue(layers.channels[ch], kMaxLayers));
+  for(int32 ch = 0; ch < 16; ++ch){
+    const ChannelTransform& settings = transform.channels[ch];
+    setParamNormalized(kChVelocityId + ch, ListValue(settings.velocity, kVelCurveCount));
+    setParamNormalized(kChTransposeId + ch, (double)(settings.transpose + kMaxTranspose) / (2 * kMaxTranspose));
+    setParamNormalized(kChKeyLowId + ch, settings.keyLow / 127.);
+    setParamNormalized(kChKeyHighId + ch, settings.keyHigh / 127.);
+    setParamNormalized(kChOutputId + ch, ListValue(settings.channel, 16));
+    setParamNormalized(kChEventsId + ch, ListValue(settings.events, kEventsCount));
+  }
   // BAD SDK: it is goot time now, we used messege to transfer it
   //  It is unclear will host call GetState or SetState for processor in case of this one
   //  REAPER called GetState first (so "empty"), but then it can call SetState and setComponentState
@@ -762,7 +2817,7 @@ tresult PLUGIN_API Controller::getMidiControllerAssignment(int32 busIndex, int16
   if((midiControllerNumber >= Vst::kCountCtrlNumber) || !szCCName[midiControllerNumber][0])
     return kResultFalse;
   if(busIndex == 0){
-    id = 1024 + channel*1024 + midiControllerNumber;
+    id = CCParamId(channel, midiControllerNumber);
     // printf("ID = %d %d -> %d\n", channel, midiControllerNumber, id);
     return kResultOk;
   }
@@ -784,6 +2839,11 @@ tresult PLUGIN_API Controller::getUnitByBus(Vst::MediaType type, Vst::BusDirecti
 }
 
 tresult PLUGIN_API Controller::setParamNormalized (Vst::ParamID tag, Vst::ParamValue value){
+  int32 ch, ctrlNumber;
+  if(IsCCParam(tag, ch, ctrlNumber)){
+    mCCValues[ch][ctrlNumber] = std::max(0., std::min(value, 1.));
+    return kResultTrue;
+  }
   tresult result = EditControllerEx1::setParamNormalized(tag, value);
   if(result == kResultOk){
     if(tag == kRootPrgId){
@@ -906,80 +2966,6 @@ void FluidSynthVST::PathAppend(char *szPath /* Out */, int32 size, const char *s
   strcat(szPath, szName);
 }
 
-void FluidSynthVST::Processor::scanSoundFonts(){
-  WCHAR szName[MAX_PATH];
-  if(GetModuleFileNameW((HMODULE)moduleHandle, szName, MAX_PATH) <= 0)
-    return;
-  szName[MAX_PATH - 1] = 0;
-  WCHAR *slash = wcsrchr(szName, L'\\');
-  if(slash)
-    *slash = 0;
-  wcscat(szName, L"\\*.sf?");
-
-  HANDLE hFind;
-  WIN32_FIND_DATA FindData;
-  if((hFind = FindFirstFileW(szName, &FindData)) != INVALID_HANDLE_VALUE){
-    do {
-      slash = wcsrchr(FindData.cFileName, L'\\');
-      if(slash)
-	++slash;
-      else
-	slash = FindData.cFileName;
-      String s(slash);
-      s.toMultiByte(kCP_Utf8);
-      const char *cstr = s.text8();
-      // used pattern is translated using DOS wildcards, f.e. it will match name.sfpack
-      if((strlen(cstr) > 3) && !memcmp(cstr + strlen(cstr) - 4, ".sf", 3))
-	mSoundFontFiles.push_back( s );
-    } while(FindNextFileW(hFind, &FindData));
-    FindClose(hFind);
-    std::sort(mSoundFontFiles.begin(), mSoundFontFiles.end());
-  }
-  if(mSoundFontFiles.size() == 0)
-    mSoundFontFiles.push_back( "default.sf2" );
-}
-
-static DWORD WINAPI Processor_LoadingThread(void *par){
-  auto processor = static_cast<FluidSynthVST::Processor *>(par);
-  processor->syncedLoadSoundFont();
-  return NULL;
-}
-
-/*
- * Returns true in case the synth can be used.
- * Initiate font loading, synced or asynced as specified in case that was requested.
- * Also finish loading in specified mode
- *
- * It is not thread safe, but it can be called from
- * destructor, setProcessing or process only. Host should never
- * parallelize any of them.
- */
-bool FluidSynthVST::Processor::checkSoundFont(bool synced){
-  //PerfMeter pm("Check", 8000);
-  if(mLoadingThread){
-    if(mLoadingComplete || synced){
-      CloseHandle(mLoadingThread);
-      mLoadingThread = 0;
-      //printf("Processor: loading font complete\n");
-    } else
-      return false;
-  }
-  if(!mChangeSoundFont)
-    return true;
-  //printf("Processor: changing sound font %s\n", synced ? "synced" : "asynced");
-  mLoadedFile = mSoundFontFile;
-  mChangeSoundFont = false;
-  if(!synced){
-    mLoadingComplete = false;
-    if((mLoadingThread = CreateThread(NULL, 0, Processor_LoadingThread, this, 0, NULL)))
-      return false;
-    printf("Could not create loading thread, continue in synced mode\n");
-  }
-  syncedLoadSoundFont();
-  return true;
-}
-
-
 #else /* Linux */
 #define glib_DllMain(x,y,z)
 
@@ -1004,70 +2990,6 @@ void FluidSynthVST::PathAppend(char *szPath /* Out */, int32 size, const char *s
   strcat(szPath, szName);
 }
 
-#include <sys/types.h>
-#include <dirent.h>
-
-void FluidSynthVST::Processor::scanSoundFonts(){
-  char szDirName[FILENAME_MAX];
-  GetPath(szDirName, FILENAME_MAX);
-  DIR *dir = opendir(szDirName);
-  if(dir){
-    struct dirent *de;
-    while((de = readdir(dir))){
-      if((strlen(de->d_name) > 4) && !memcmp(de->d_name + strlen(de->d_name) - 4, ".sf", 3)){
-	mSoundFontFiles.push_back( de->d_name ); // will be in file system encoding, hope it is UTF8
-      }
-    }
-    closedir(dir);
-    std::sort(mSoundFontFiles.begin(), mSoundFontFiles.end());
-  }
-  if(mSoundFontFiles.size() == 0)
-    mSoundFontFiles.push_back( "default.sf2" );
-}
-
-#include <pthread.h>
-
-static void *Processor_LoadingThread(void *par){
-  auto processor = static_cast<FluidSynthVST::Processor *>(par);
-  processor->syncedLoadSoundFont();
-  return NULL;
-}
-
-/*
- * Returns true in case the synth can be used.
- * Initiate font loading, synced or asynced as specified in case that was requested.
- * Also finish loading in specified mode
- *
- * It is not thread safe, but it can be called from
- * destructor, setProcessing or process only. Host should never
- * parallelize any of them.
- */
-bool FluidSynthVST::Processor::checkSoundFont(bool synced){
-  //PerfMeter pm("Check", 8000);
-  if(mLoadingThread){
-    if(mLoadingComplete || synced){
-      pthread_join(mLoadingThread, NULL);
-      mLoadingThread = 0;
-      //printf("Processor: loading font complete\n");
-    } else
-      return false;
-  }
-  if(!mChangeSoundFont)
-    return true;
-  //printf("Processor: changing sound font %s\n", synced ? "synced" : "asynced");
-  mLoadedFile = mSoundFontFile;
-  mChangeSoundFont = false;
-  if(!synced){
-    mLoadingComplete = false;
-    if(!pthread_create(&mLoadingThread, NULL, Processor_LoadingThread, this)){
-      return false;
-    }
-    printf("Could not create loading thread, continue in synced mode\n");
-  }
-  syncedLoadSoundFont();
-  return true;
-}
-
 #endif
 
 
@@ -1078,6 +3000,8 @@ bool InitModule(){
 }
 
 bool DeinitModule(){
+  FluidSynthVST::StopSoundFontLoader();
+  FluidSynthVST::StopTelemetry();
   glib_DllMain(moduleHandle, DLL_PROCESS_DETACH, NULL);
   return true;
 }
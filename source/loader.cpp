@@ -0,0 +1,189 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/fluidsynthvst.h"
+#include "../include/loader.h"
+#include "../include/sfcache.h"
+
+namespace FluidSynthVST {
+
+using Clock = std::chrono::steady_clock;
+
+struct LoadRequest {
+  Processor        *processor;
+  std::string       fileName;
+  uint32            generation;
+  Clock::time_point startAfter;
+};
+
+static std::mutex                gLoaderMutex;
+static std::condition_variable   gLoaderCondition;  // new request or stop
+static std::condition_variable   gLoaderDone;       // a request is finished
+static std::deque<LoadRequest>   gLoaderQueue;
+static std::vector<Processor *>  gLoaderRunning;
+static std::vector<Processor *>  gPrefetchProcessors;
+static std::vector<std::thread>  gLoaderThreads;
+static bool                      gLoaderStop = false;
+
+static void LoaderThread(){
+  std::unique_lock<std::mutex> lock(gLoaderMutex);
+  while(!gLoaderStop){
+    // process can not request itself, it only leaves the request for us
+    auto rit = std::find_if(gPrefetchProcessors.begin(), gPrefetchProcessors.end(), [](Processor *processor){
+	return (std::find(gLoaderRunning.begin(), gLoaderRunning.end(), processor) == gLoaderRunning.end()) &&
+	  processor->hasProcessRequest();
+      });
+    if(rit != gPrefetchProcessors.end()){
+      Processor *processor = *rit;
+      gLoaderRunning.push_back(processor);
+      lock.unlock();
+      processor->takeProcessRequest(); // queues with RequestSoundFont
+      lock.lock();
+      gLoaderRunning.erase(std::find(gLoaderRunning.begin(), gLoaderRunning.end(), processor));
+      gLoaderDone.notify_all();
+      continue;
+    }
+    // the first ready, in order of arrival
+    Clock::time_point now = Clock::now();
+    Clock::time_point wakeUp = Clock::time_point::max();
+    auto it = gLoaderQueue.begin();
+    for(; it != gLoaderQueue.end(); ++it){
+      if(it->startAfter <= now)
+	break;
+      wakeUp = std::min(wakeUp, it->startAfter);
+    }
+    if(it == gLoaderQueue.end()){
+      // on demand sample loading and eviction, module wide
+      if(HasSharedPresetWork()){
+	lock.unlock();
+	ServeSharedPresets();
+	lock.lock();
+	continue;
+      }
+      // prefetch, one worker per processor
+      auto pit = std::find_if(gPrefetchProcessors.begin(), gPrefetchProcessors.end(), [](Processor *processor){
+	  return (std::find(gLoaderRunning.begin(), gLoaderRunning.end(), processor) == gLoaderRunning.end()) &&
+	    processor->hasPrefetch();
+	});
+      if(pit != gPrefetchProcessors.end()){
+	Processor *processor = *pit;
+	gLoaderRunning.push_back(processor);
+	lock.unlock();
+	processor->prefetchPresets();
+	lock.lock();
+	gLoaderRunning.erase(std::find(gLoaderRunning.begin(), gLoaderRunning.end(), processor));
+	gLoaderDone.notify_all();
+	continue;
+      }
+      if(!gPrefetchProcessors.empty())
+	wakeUp = std::min(wakeUp, now + std::chrono::milliseconds(kPrefetchPollMs));
+      if(wakeUp == Clock::time_point::max())
+	gLoaderCondition.wait(lock);
+      else
+	gLoaderCondition.wait_until(lock, std::max(wakeUp, now + std::chrono::milliseconds(1)));
+      continue;
+    }
+    LoadRequest request = *it;
+    gLoaderQueue.erase(it);
+    gLoaderRunning.push_back(request.processor);
+    lock.unlock();
+
+    fluid_synth_t *synth = NULL;
+    Sf2Info info;
+    uint32 capture = 0;
+    if(request.processor->isCurrentRequest(request.generation))
+      synth = request.processor->loadSoundFont(request.fileName.c_str(), info, capture);
+    request.processor->completeLoading(synth, info, request.generation, capture); // can discard it
+
+    lock.lock();
+    gLoaderRunning.erase(std::find(gLoaderRunning.begin(), gLoaderRunning.end(), request.processor));
+    gLoaderDone.notify_all();
+  }
+}
+
+void StartSoundFontLoader(){
+  std::lock_guard<std::mutex> lock(gLoaderMutex);
+  if(gLoaderStop || !gLoaderThreads.empty())
+    return;
+  for(int32 i = 0; i < kLoaderThreads; ++i)
+    gLoaderThreads.emplace_back(LoaderThread);
+}
+
+void RequestSoundFont(Processor *processor, const char *fileName, uint32 generation, bool isDefault){
+  std::lock_guard<std::mutex> lock(gLoaderMutex);
+  if(gLoaderStop)
+    return;
+  Clock::time_point startAfter = Clock::now();
+  if(isDefault)
+    startAfter += std::chrono::milliseconds(kDefaultFontDelayMs);
+  auto it = std::find_if(gLoaderQueue.begin(), gLoaderQueue.end(), [processor](const LoadRequest& request){
+      return request.processor == processor;
+    });
+  if(it != gLoaderQueue.end()){ // latest wins
+    it->fileName = fileName;
+    it->generation = generation;
+    it->startAfter = startAfter;
+  } else {
+    gLoaderQueue.push_back(LoadRequest{processor, fileName, generation, startAfter});
+  }
+  gLoaderCondition.notify_one();
+}
+
+void RegisterPrefetch(Processor *processor){
+  std::lock_guard<std::mutex> lock(gLoaderMutex);
+  gPrefetchProcessors.push_back(processor);
+}
+
+void WakeSoundFontLoader(){
+  gLoaderCondition.notify_one();
+}
+
+void CancelSoundFontRequests(Processor *processor){
+  std::unique_lock<std::mutex> lock(gLoaderMutex);
+  gPrefetchProcessors.erase(std::remove(gPrefetchProcessors.begin(), gPrefetchProcessors.end(), processor),
+			    gPrefetchProcessors.end());
+  gLoaderQueue.erase(std::remove_if(gLoaderQueue.begin(), gLoaderQueue.end(), [processor](const LoadRequest& request){
+	return request.processor == processor;
+      }), gLoaderQueue.end());
+  gLoaderDone.wait(lock, [processor]{
+      return std::find(gLoaderRunning.begin(), gLoaderRunning.end(), processor) == gLoaderRunning.end();
+    });
+}
+
+void StopSoundFontLoader(){
+  {
+    std::lock_guard<std::mutex> lock(gLoaderMutex);
+    gLoaderStop = true;
+    gLoaderCondition.notify_all();
+  }
+  for(auto& thread : gLoaderThreads)
+    thread.join();
+  gLoaderThreads.clear();
+}
+
+}
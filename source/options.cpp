@@ -0,0 +1,114 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../include/fluidsynthvst.h"
+#include "../include/options.h"
+
+namespace FluidSynthVST {
+
+Options::Options() : hotSwap(true), mmapFiles(true), multiOut(false), telemetry(false), rescanSec(0), lockMb(0), onDemand(false), evictSec(60), sf3Cache(true), stream(false), streamHeadMs(250), midiThru(false), ccGranularity(0) {
+}
+
+static bool OptionBool(const char *value){
+  return atoi(value) != 0;
+}
+
+void Options::set(const char *name, const char *value){
+  if(!strcmp(name, "hotswap"))
+    hotSwap = OptionBool(value);
+  else if(!strcmp(name, "mmap"))
+    mmapFiles = OptionBool(value);
+  else if(!strcmp(name, "multiout"))
+    multiOut = OptionBool(value);
+  else if(!strcmp(name, "telemetry"))
+    telemetry = OptionBool(value);
+  else if(!strcmp(name, "library")){
+    if(*value)
+      libraryDirs.push_back(value);
+  } else if(!strcmp(name, "rescan"))
+    rescanSec = atoi(value);
+  else if(!strcmp(name, "lock"))
+    lockMb = std::max(0, atoi(value));
+  else if(!strcmp(name, "ondemand"))
+    onDemand = OptionBool(value);
+  else if(!strcmp(name, "evict"))
+    evictSec = std::max(0, atoi(value));
+  else if(!strcmp(name, "sf3cache"))
+    sf3Cache = OptionBool(value);
+  else if(!strcmp(name, "cachedir"))
+    cacheDir = value;
+  else if(!strcmp(name, "stream"))
+    stream = OptionBool(value);
+  else if(!strcmp(name, "streamhead"))
+    streamHeadMs = std::max(0, atoi(value));
+  else if(!strcmp(name, "midithru"))
+    midiThru = OptionBool(value);
+  else if(!strcmp(name, "ccgranularity"))
+    ccGranularity = std::max(0, atoi(value));
+  else
+    printf("Unknown option '%s'\n", name);
+}
+
+static char *Trim(char *s){
+  while(isspace(*s))
+    ++s;
+  char *end = s + strlen(s);
+  while((end > s) && isspace(end[-1]))
+    --end;
+  *end = 0;
+  return s;
+}
+
+static Options LoadOptions(){
+  Options options;
+  char fileName[FILENAME_MAX];
+  GetPath(fileName, FILENAME_MAX);
+  PathAppend(fileName, FILENAME_MAX, "fluidsynthvst.ini");
+  FILE *f = fopen(fileName, "r");
+  if(f){
+    char line[FILENAME_MAX + 64];
+    while(fgets(line, sizeof(line), f)){
+      char *comment = strchr(line, '#');
+      if(comment)
+	*comment = 0;
+      char *eq = strchr(line, '=');
+      if(!eq)
+	continue;
+      *eq = 0;
+      char *name = Trim(line);
+      if(*name)
+	options.set(name, Trim(eq + 1));
+    }
+    fclose(f);
+  }
+  return options;
+}
+
+const Options& GetOptions(){
+  static const Options options = LoadOptions(); // thread safe
+  return options;
+}
+
+}
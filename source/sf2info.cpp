@@ -0,0 +1,229 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "../include/sf2info.h"
+
+namespace FluidSynthVST {
+
+// SoundFont 2.04 specification, generator numbers and limits
+static const int kGenReleaseVolEnv = 38;
+static const int kGenInstrument = 41;
+static const int kGenSampleID = 53;
+static const int kDefaultReleaseTc = -12000; // timecents, ~1ms
+static const int kMaxReleaseTc = 8000;       // ~100 sec
+
+struct Sf2Bag {
+  unsigned genIdx;
+};
+
+struct Sf2Gen {
+  unsigned oper;
+  int      amount;
+};
+
+static unsigned GetU16(const unsigned char *p){
+  return p[0] | (p[1] << 8);
+}
+
+static unsigned GetU32(const unsigned char *p){
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+/*
+ * For each (preset or instrument) header, walk its zones. A zone which does not end with
+ * terminal generator (sampleID or instrument) is the global one when it is the first.
+ * Returns the maximum of releaseVolEnv over zones, using global value for not set local one,
+ * default when nothing is set.
+ */
+static int MaxRelease(const std::vector<unsigned>& headerBags, const std::vector<Sf2Bag>& bags,
+		      const std::vector<Sf2Gen>& gens, unsigned terminalGen, int defaultValue){
+  int maxRelease = -32768;
+  for(size_t h = 0; h + 1 < headerBags.size(); ++h){ // the last header is terminal
+    int globalRelease = defaultValue;
+    for(unsigned b = headerBags[h]; (b < headerBags[h + 1]) && (b + 1 < bags.size()); ++b){
+      bool hasRelease = false, isTerminated = false;
+      int release = 0;
+      for(unsigned g = bags[b].genIdx; (g < bags[b + 1].genIdx) && (g < gens.size()); ++g){
+	if(gens[g].oper == kGenReleaseVolEnv){
+	  release = gens[g].amount;
+	  hasRelease = true;
+	} else if(gens[g].oper == terminalGen)
+	  isTerminated = true;
+      }
+      if(!isTerminated){
+	if((b == headerBags[h]) && hasRelease)
+	  globalRelease = release;
+	continue;
+      }
+      maxRelease = std::max(maxRelease, hasRelease ? release : globalRelease);
+    }
+  }
+  return (maxRelease == -32768) ? defaultValue : maxRelease;
+}
+
+// Indexes (instruments or samples) referenced by zones of the header, by the terminal generator
+static void ZoneTargets(const std::vector<unsigned>& headerBags, size_t h, const std::vector<Sf2Bag>& bags,
+			const std::vector<Sf2Gen>& gens, unsigned terminalGen, std::vector<unsigned>& targets){
+  for(unsigned b = headerBags[h]; (b < headerBags[h + 1]) && (b + 1 < bags.size()); ++b){
+    for(unsigned g = bags[b].genIdx; (g < bags[b + 1].genIdx) && (g < gens.size()); ++g){
+      if(gens[g].oper == terminalGen)
+	targets.push_back((unsigned short)gens[g].amount);
+    }
+  }
+}
+
+static void ReadPresetSamples(const std::vector<unsigned>& presetBags, const std::vector<std::pair<int, int>>& presetIds,
+			      const std::vector<Sf2Bag>& pbags, const std::vector<Sf2Gen>& pgens,
+			      const std::vector<unsigned>& instBags, const std::vector<Sf2Bag>& ibags,
+			      const std::vector<Sf2Gen>& igens, const std::vector<std::pair<unsigned, unsigned>>& samples,
+			      std::vector<Sf2PresetSamples>& presets){
+  for(size_t h = 0; h + 1 < presetBags.size(); ++h){ // the last header is terminal
+    Sf2PresetSamples preset{presetIds[h].first, presetIds[h].second, {}};
+    std::vector<unsigned> insts, sampleIds;
+    ZoneTargets(presetBags, h, pbags, pgens, kGenInstrument, insts);
+    for(unsigned inst : insts){
+      if(inst + 1 < instBags.size())
+	ZoneTargets(instBags, inst, ibags, igens, kGenSampleID, sampleIds);
+    }
+    for(unsigned id : sampleIds){
+      if((id < samples.size()) && (samples[id].first < samples[id].second))
+	preset.ranges.push_back(samples[id]);
+    }
+    std::sort(preset.ranges.begin(), preset.ranges.end());
+    size_t merged = 0;
+    for(size_t i = 1; i < preset.ranges.size(); ++i){
+      if(preset.ranges[i].first <= preset.ranges[merged].second)
+	preset.ranges[merged].second = std::max(preset.ranges[merged].second, preset.ranges[i].second);
+      else
+	preset.ranges[++merged] = preset.ranges[i];
+    }
+    if(!preset.ranges.empty())
+      preset.ranges.resize(merged + 1);
+    presets.push_back(preset);
+  }
+  std::sort(presets.begin(), presets.end(), [](const Sf2PresetSamples& a, const Sf2PresetSamples& b){
+      return (a.bank < b.bank) || ((a.bank == b.bank) && (a.program < b.program));
+    });
+}
+
+bool ReadSf2Info(const char *fileName, Sf2Info& info){
+  FILE *f = fopen(fileName, "rb");
+  if(!f)
+    return false;
+  unsigned char hdr[12];
+  if((fread(hdr, 1, 12, f) != 12) || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "sfbk", 4)){
+    fclose(f);
+    return false;
+  }
+  // find pdta LIST, skipping everything else (sdta is the big one)
+  long pdtaSize = 0;
+  unsigned char chunk[12];
+  while(fread(chunk, 1, 8, f) == 8){
+    unsigned size = GetU32(chunk + 4);
+    if(!memcmp(chunk, "LIST", 4)){
+      if(fread(chunk + 8, 1, 4, f) != 4)
+	break;
+      if(!memcmp(chunk + 8, "pdta", 4)){
+	pdtaSize = size - 4;
+	break;
+      }
+      size -= 4;
+      if(!memcmp(chunk + 8, "INFO", 4)){
+	// "ifil" is the first sub chunk
+	unsigned char ifil[12];
+	if((size >= 12) && (fread(ifil, 1, 12, f) == 12)){
+	  if(!memcmp(ifil, "ifil", 4))
+	    info.version = GetU16(ifil + 8);
+	  size -= 12;
+	}
+      }
+    }
+    if(fseek(f, size + (size & 1), SEEK_CUR))
+      break;
+  }
+  std::vector<unsigned char> pdta(pdtaSize > 0 ? pdtaSize : 0);
+  bool ok = (pdtaSize > 0) && (fread(pdta.data(), 1, pdtaSize, f) == (size_t)pdtaSize);
+  fclose(f);
+  if(!ok)
+    return false;
+
+  std::vector<unsigned> presetBags, instBags;
+  std::vector<std::pair<int, int>> presetIds; // bank, program
+  std::vector<std::pair<unsigned, unsigned>> samples;
+  std::vector<Sf2Bag> pbags, ibags;
+  std::vector<Sf2Gen> pgens, igens;
+  for(long pos = 0; pos + 8 <= pdtaSize; ){
+    const unsigned char *p = pdta.data() + pos;
+    unsigned size = GetU32(p + 4);
+    if(pos + 8 + (long)size > pdtaSize)
+      break;
+    const unsigned char *data = p + 8;
+    if(!memcmp(p, "phdr", 4)){
+      for(unsigned i = 0; i + 38 <= size; i += 38){
+	presetIds.push_back(std::make_pair((int)GetU16(data + i + 22), (int)GetU16(data + i + 20)));
+	presetBags.push_back(GetU16(data + i + 24));
+      }
+    } else if(!memcmp(p, "inst", 4)){
+      for(unsigned i = 0; i + 22 <= size; i += 22)
+	instBags.push_back(GetU16(data + i + 20));
+    } else if(!memcmp(p, "shdr", 4)){
+      for(unsigned i = 0; i + 46 <= size; i += 46)
+	samples.push_back(std::make_pair(GetU32(data + i + 20), GetU32(data + i + 24)));
+    } else if(!memcmp(p, "pbag", 4) || !memcmp(p, "ibag", 4)){
+      std::vector<Sf2Bag>& bags = (p[0] == 'p') ? pbags : ibags;
+      for(unsigned i = 0; i + 4 <= size; i += 4)
+	bags.push_back(Sf2Bag{GetU16(data + i)});
+    } else if(!memcmp(p, "pgen", 4) || !memcmp(p, "igen", 4)){
+      std::vector<Sf2Gen>& gens = (p[0] == 'p') ? pgens : igens;
+      for(unsigned i = 0; i + 4 <= size; i += 4)
+	gens.push_back(Sf2Gen{GetU16(data + i), (short)GetU16(data + i + 2)});
+    }
+    pos += 8 + size + (size & 1);
+  }
+
+  info.numPresets = presetBags.size() ? presetBags.size() - 1 : 0; // without terminal "EOP"
+
+  // preset generators are offsets to instrument ones, only longer release matters
+  int instRelease = MaxRelease(instBags, ibags, igens, kGenSampleID, kDefaultReleaseTc);
+  int presetOffset = std::max(0, MaxRelease(presetBags, pbags, pgens, kGenInstrument, 0));
+  int release = std::min(instRelease + presetOffset, kMaxReleaseTc);
+  info.maxReleaseSec = pow(2., release / 1200.);
+
+  info.presets.clear();
+  ReadPresetSamples(presetBags, presetIds, pbags, pgens, instBags, ibags, igens, samples, info.presets);
+  return true;
+}
+
+const Sf2PresetSamples* FindPresetSamples(const Sf2Info& info, int bank, int program){
+  auto it = std::lower_bound(info.presets.begin(), info.presets.end(), std::make_pair(bank, program),
+			     [](const Sf2PresetSamples& preset, const std::pair<int, int>& key){
+			       return (preset.bank < key.first) || ((preset.bank == key.first) && (preset.program < key.second));
+			     });
+  if((it == info.presets.end()) || (it->bank != bank) || (it->program != program))
+    return NULL;
+  return &*it;
+}
+
+}
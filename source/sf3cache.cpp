@@ -0,0 +1,334 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else /* Linux */
+#include <dirent.h>
+#include <unistd.h>
+#endif /* platform */
+
+#include "../include/sf3cache.h"
+#include "../include/fluidpriv.h"
+#include "../include/options.h"
+
+namespace FluidSynthVST {
+
+// SoundFont 2.04 specification
+static const size_t kShdrSize = 46;       // sample header record
+static const unsigned kSampleZeros = 46;  // zero points after each sample
+static const int kSampleTypeVorbis = 0x10; // SF3 extension, compressed sample
+
+static unsigned GetU32(const unsigned char *p){
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+static void SetU32(unsigned char *p, unsigned v){
+  p[0] = v & 0xff; p[1] = (v >> 8) & 0xff; p[2] = (v >> 16) & 0xff; p[3] = v >> 24;
+}
+
+static const char *BaseName(const char *path){
+  const char *name = path;
+  for(const char *p = path; *p; ++p){
+    if((*p == '/') || (*p == '\\'))
+      name = p + 1;
+  }
+  return name;
+}
+
+static std::string JoinPath(const std::string& dir, const std::string& name){
+#ifdef WIN32
+  return dir + "\\" + name;
+#else /* Linux */
+  return dir + "/" + name;
+#endif /* platform */
+}
+
+// FNV-1a
+static unsigned long long Hash(unsigned long long hash, const void *data, size_t size){
+  for(size_t i = 0; i < size; ++i){
+    hash ^= static_cast<const unsigned char *>(data)[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+#ifdef WIN32
+static std::string DefaultCacheDir(){
+  const char *base = getenv("LOCALAPPDATA");
+  return base ? JoinPath(base, "FluidSynthVST") : std::string();
+}
+
+static bool MakeDir(const std::string& dir){
+  WCHAR wszDir[MAX_PATH];
+  if(!MultiByteToWideChar(CP_UTF8, 0, dir.c_str(), -1, wszDir, MAX_PATH))
+    return false;
+  return CreateDirectoryW(wszDir, NULL) || (GetLastError() == ERROR_ALREADY_EXISTS);
+}
+
+static void RemoveStale(const std::string& dir, const std::string& prefix, const std::string& ext, const std::string& keep){
+  WCHAR szPattern[MAX_PATH];
+  if(!MultiByteToWideChar(CP_UTF8, 0, JoinPath(dir, prefix + "????????????????" + ext).c_str(), -1, szPattern, MAX_PATH))
+    return;
+  HANDLE hFind;
+  WIN32_FIND_DATAW FindData;
+  if((hFind = FindFirstFileW(szPattern, &FindData)) != INVALID_HANDLE_VALUE){
+    do {
+      char name[MAX_PATH * 3];
+      if((WideCharToMultiByte(CP_UTF8, 0, FindData.cFileName, -1, name, sizeof(name), NULL, NULL) > 0) && (keep != name))
+	remove(JoinPath(dir, name).c_str());
+    } while(FindNextFileW(hFind, &FindData));
+    FindClose(hFind);
+  }
+}
+
+static unsigned long ProcessId(){
+  return GetCurrentProcessId();
+}
+#else /* Linux */
+static std::string DefaultCacheDir(){
+  const char *base = getenv("XDG_CACHE_HOME");
+  if(base && *base)
+    return JoinPath(base, "fluidsynthvst");
+  base = getenv("HOME");
+  return base ? JoinPath(JoinPath(base, ".cache"), "fluidsynthvst") : std::string();
+}
+
+static bool MakeDir(const std::string& dir){
+  return !mkdir(dir.c_str(), 0755) || (errno == EEXIST);
+}
+
+static void RemoveStale(const std::string& dir, const std::string& prefix, const std::string& ext, const std::string& keep){
+  DIR *d = opendir(dir.c_str());
+  if(!d)
+    return;
+  struct dirent *entry;
+  while((entry = readdir(d))){
+    size_t len = strlen(entry->d_name);
+    if(!strncmp(entry->d_name, prefix.c_str(), prefix.size()) && (len == prefix.size() + 16 + ext.size()) &&
+       !strcmp(entry->d_name + len - ext.size(), ext.c_str()) && (keep != entry->d_name))
+      unlink(JoinPath(dir, entry->d_name).c_str());
+  }
+  closedir(d);
+}
+
+static unsigned long ProcessId(){
+  return getpid();
+}
+#endif /* platform */
+
+static std::string CacheDir(){
+  const std::string& dir = GetOptions().cacheDir;
+  return dir.empty() ? DefaultCacheDir() : dir;
+}
+
+// Cache names are "<font name>-<16 hex digits hash><ext>", the prefix is the same for all versions
+static std::string CachePrefix(const char *fileName){
+  return std::string(BaseName(fileName)) + "-";
+}
+
+static const char *kDecodedExt = ".sf2";
+static const char *kStreamCopyExt = ".smpl";
+
+// The hash is of the key (name or path), the file size, modification time and FluidSynth version
+static bool CachePath(const char *fileName, const char *key, const char *ext, std::string& path){
+  path.clear();
+  struct stat st;
+  std::string dir = CacheDir();
+  if(dir.empty() || stat(fileName, &st))
+    return false;
+  long long size = st.st_size, mtime = st.st_mtime;
+  const char *version = fluid_version_str();
+  unsigned long long hash = Hash(14695981039346656037ULL, key, strlen(key));
+  hash = Hash(hash, &size, sizeof(size));
+  hash = Hash(hash, &mtime, sizeof(mtime));
+  hash = Hash(hash, version, strlen(version));
+  char szHash[20];
+  snprintf(szHash, sizeof(szHash), "%016llx", hash);
+  path = JoinPath(dir, CachePrefix(fileName) + szHash + ext);
+  return true;
+}
+
+static void MakeCacheDir(const std::string& dir){
+  size_t dirSep = dir.find_last_of("/\\");
+  if(dirSep != std::string::npos)
+    MakeDir(dir.substr(0, dirSep));
+  MakeDir(dir);
+}
+
+bool DecodedSoundFontPath(const char *fileName, std::string& path){
+  path.clear();
+  return GetOptions().sf3Cache && CachePath(fileName, BaseName(fileName), kDecodedExt, path);
+}
+
+// Reads "INFO" and "pdta" LISTs of the file, with headers
+static bool ReadLists(const char *fileName, std::vector<unsigned char>& info, std::vector<unsigned char>& pdta){
+  FILE *f = fopen(fileName, "rb");
+  if(!f)
+    return false;
+  unsigned char hdr[12];
+  if((fread(hdr, 1, 12, f) != 12) || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "sfbk", 4)){
+    fclose(f);
+    return false;
+  }
+  unsigned char chunk[12];
+  while((info.empty() || pdta.empty()) && (fread(chunk, 1, 8, f) == 8)){
+    unsigned size = GetU32(chunk + 4);
+    if(!memcmp(chunk, "LIST", 4) && (size >= 4)){
+      if(fread(chunk + 8, 1, 4, f) != 4)
+	break;
+      std::vector<unsigned char> *list = !memcmp(chunk + 8, "INFO", 4) ? &info : !memcmp(chunk + 8, "pdta", 4) ? &pdta : NULL;
+      if(list){
+	list->assign(chunk, chunk + 12);
+	list->resize(8 + size);
+	if(fread(list->data() + 12, 1, size - 4, f) != size - 4){
+	  list->clear();
+	  break;
+	}
+	continue;
+      }
+      size -= 4;
+    }
+    if(fseek(f, size + (size & 1), SEEK_CUR))
+      break;
+  }
+  fclose(f);
+  return !info.empty() && !pdta.empty();
+}
+
+// Sub chunk of the LIST with headers, NULL when not found
+static unsigned char *FindSubChunk(std::vector<unsigned char>& list, const char *id, unsigned& size){
+  for(size_t pos = 12; pos + 8 <= list.size(); ){
+    size = GetU32(list.data() + pos + 4);
+    if(pos + 8 + size > list.size())
+      break;
+    if(!memcmp(list.data() + pos, id, 4))
+      return list.data() + pos;
+    pos += 8 + size + (size & 1);
+  }
+  return NULL;
+}
+
+// Keyed by the full path, fonts with the same name in different folders are different
+bool StreamCopyPath(const char *fileName, std::string& path, std::string& tmpPath){
+  static std::atomic<unsigned> number(0);
+  tmpPath.clear();
+  if(!CachePath(fileName, fileName, kStreamCopyExt, path))
+    return false;
+  MakeCacheDir(CacheDir());
+  // several workers can copy the same font
+  tmpPath = path + "." + std::to_string(ProcessId()) + "." + std::to_string(++number) + ".tmp";
+  return true;
+}
+
+bool CommitStreamCopy(const char *fileName, const std::string& tmpPath, const std::string& path){
+  remove(path.c_str()); // rename does not replace on Windows
+  if(rename(tmpPath.c_str(), path.c_str()))
+    return false;
+  RemoveStale(CacheDir(), CachePrefix(fileName), kStreamCopyExt, path.substr(path.find_last_of("/\\") + 1));
+  return true;
+}
+
+bool WriteDecodedSoundFont(const char *fileName, const std::string& path, fluid_sfont_t *sfont){
+  const FluidDefSFontPriv *defsfont = FluidPrivCompatible() ? FluidDefSFont(sfont) : NULL;
+  std::vector<unsigned char> info, pdta;
+  if(!defsfont || !ReadLists(fileName, info, pdta))
+    return false;
+  unsigned size;
+  unsigned char *ifil = FindSubChunk(info, "ifil", size);
+  unsigned char *shdr = FindSubChunk(pdta, "shdr", size);
+  if(!ifil || !shdr || (size % kShdrSize) || (size < kShdrSize))
+    return false;
+  shdr += 8;
+  size_t numSamples = size / kShdrSize - 1; // the last is terminal
+  // loaded samples are in the file order, all should be decoded
+  std::vector<const FluidSamplePriv *> samples;
+  for(const FluidListPriv *item = defsfont->sample; item; item = item->next)
+    samples.push_back(static_cast<const FluidSamplePriv *>(item->data));
+  if(samples.size() != numSamples)
+    return false;
+  std::vector<short> smpl;
+  for(size_t i = 0; i < numSamples; ++i){
+    const FluidSamplePriv *sample = samples[i];
+    unsigned char *rec = shdr + i * kShdrSize;
+    if(strncmp(sample->name, reinterpret_cast<const char *>(rec), 20))
+      return false;
+    unsigned offset = smpl.size(), len = 0;
+    if(sample->data && (sample->end >= sample->start)){
+      len = sample->end - sample->start + 1;
+      smpl.insert(smpl.end(), sample->data + sample->start, sample->data + sample->end + 1);
+    } else if(GetU32(rec + 24) > GetU32(rec + 20))
+      return false; // not loaded, f.e. dynamic loading
+    smpl.insert(smpl.end(), kSampleZeros, 0);
+    if(smpl.size() > 0x7ffffff0) // smpl size in bytes is 32bit
+      return false;
+    SetU32(rec + 20, offset);
+    SetU32(rec + 24, offset + len);
+    SetU32(rec + 28, len ? offset + (sample->loopstart - sample->start) : offset);
+    SetU32(rec + 32, len ? offset + (sample->loopend - sample->start) : offset);
+    rec[44] &= ~kSampleTypeVorbis;
+  }
+  ifil[8] = 2; ifil[9] = 0;   // version 2.01
+  ifil[10] = 1; ifil[11] = 0;
+
+  std::string dir = CacheDir();
+  MakeCacheDir(dir);
+  std::string tmpPath = path + "." + std::to_string(ProcessId()) + ".tmp";
+  FILE *f = fopen(tmpPath.c_str(), "wb");
+  if(!f)
+    return false;
+  unsigned smplSize = smpl.size() * 2;
+  unsigned char hdr[12];
+  memcpy(hdr, "RIFF", 4);
+  SetU32(hdr + 4, 4 + info.size() + 12 + 8 + smplSize + pdta.size());
+  memcpy(hdr + 8, "sfbk", 4);
+  bool ok = fwrite(hdr, 1, 12, f) == 12;
+  ok = ok && (fwrite(info.data(), 1, info.size(), f) == info.size());
+  unsigned char sdta[20];
+  memcpy(sdta, "LIST", 4);
+  SetU32(sdta + 4, 4 + 8 + smplSize);
+  memcpy(sdta + 8, "sdtasmpl", 8);
+  SetU32(sdta + 16, smplSize);
+  ok = ok && (fwrite(sdta, 1, 20, f) == 20);
+  // sample points are little endian, as the host
+  ok = ok && (fwrite(smpl.data(), 2, smpl.size(), f) == smpl.size());
+  ok = ok && (fwrite(pdta.data(), 1, pdta.size(), f) == pdta.size());
+  ok = !fclose(f) && ok;
+  remove(path.c_str()); // rename does not replace on Windows
+  if(!ok || rename(tmpPath.c_str(), path.c_str())){
+    remove(tmpPath.c_str());
+    return false;
+  }
+  RemoveStale(dir, CachePrefix(fileName), kDecodedExt, path.substr(path.find_last_of("/\\") + 1));
+  //printf("Decoded '%s' into '%s'\n", fileName, path.c_str());
+  return true;
+}
+
+}
@@ -0,0 +1,875 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else /* Linux */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif /* platform */
+
+#include "../include/sfcache.h"
+#include "../include/fluidpriv.h"
+#include "../include/loader.h"
+#include "../include/options.h"
+#include "../include/sf2info.h"
+#include "../include/sf3cache.h"
+
+namespace FluidSynthVST {
+
+using Clock = std::chrono::steady_clock;
+
+/*
+ * Preset of cached sfont, data of proxy presets. channels and loaded are used from
+ * audio threads, loaded is always true without on demand loading and for streamed fonts.
+ */
+struct SharedPreset {
+  fluid_preset_t    *preset;
+  std::atomic<int>   channels;     // of all synths, which have selected it
+  std::atomic<bool>  loaded;       // samples
+  Clock::time_point  unusedSince;  // loader workers, max when selected or not loaded
+  bool               streamed;     // samples are in the file mapping
+  Clock::time_point  readAhead;    // loader workers, the last read ahead of streamed samples
+};
+
+/*
+ * Cache entry. The sfont is loaded into a private (never playing) synth, other synths
+ * never see it directly. users counts proxies (so synths) which have not released it yet.
+ * Each entry has own private synth, so different files can be loaded in parallel.
+ */
+struct SharedSoundFont {
+  std::string    path;
+  time_t         mtime;
+  off_t          size;
+  fluid_synth_t *synth;
+  fluid_sfont_t *sfont;   // NULL while loading or when failed
+  bool           loading;
+  int            users;
+  Sf2Info        info;    // sample ranges of presets
+  std::map<int, int> locks; // locked presets (bank * 128 + program) and lock counts
+  std::vector<std::unique_ptr<SharedPreset>> presets;
+  bool           streamed;
+};
+
+// Per synth sfont, presets are created in advance so get_preset does not allocate
+struct SoundFontProxy {
+  SharedSoundFont *shared;
+  std::vector<fluid_preset_t *> presets; // sorted by bank and program
+  size_t iteration;
+};
+
+static std::mutex                 gCacheMutex;
+static std::condition_variable    gCacheLoaded;
+static std::list<SharedSoundFont> gCache;
+static fluid_settings_t          *gCacheSettings = NULL;
+
+static std::atomic<bool>          gPresetsServing(false);   // by one loader worker at a time
+static std::atomic<bool>          gPresetsWanted(false);    // some selected preset is not loaded
+static std::atomic<long long>     gPresetsChecked(0);       // the last serve, ms
+
+// Samples are not loaded with the font, with on demand loading and streaming
+static bool DynamicSamples(){
+  return (GetOptions().onDemand || GetOptions().stream) && FluidPrivCompatible();
+}
+
+static bool StreamSoundFont(fluid_sfont_t *sfont, const Sf2Info& info, bool decoded);
+static void LockSampleHeads(fluid_sfont_t *sfont);
+
+
+/*
+ * Memory mapped file callbacks for SoundFont loader.
+ *
+ * The default loader reads with stdio. Mapped, "reading" is a copy from
+ * the page cache without system calls. FluidSynth still copies the samples into
+ * own buffers (that is not configurable in FluidSynth 2.0), so the memory use is
+ * the same as with stdio, with the cache that copy is once per module. Samples are
+ * played from the mapping without the copy with streaming only (see StreamSoundFont).
+ */
+struct MappedFile {
+  const char *data;
+  size_t      size;
+  size_t      pos;
+#ifdef WIN32
+  HANDLE      mapping;
+#endif /* platform */
+};
+
+#ifdef WIN32
+static void *MappedFileOpen(const char *filename){
+  WCHAR wszName[MAX_PATH];
+  if(MultiByteToWideChar(CP_UTF8, 0, filename, -1, wszName, MAX_PATH) <= 0)
+    return NULL;
+  HANDLE hFile = CreateFileW(wszName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(hFile == INVALID_HANDLE_VALUE)
+    return NULL;
+  LARGE_INTEGER size;
+  HANDLE mapping = NULL;
+  if(GetFileSizeEx(hFile, &size) && (size.QuadPart > 0))
+    mapping = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(hFile); // mapping keeps it
+  if(!mapping)
+    return NULL;
+  const char *data = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  if(!data){
+    CloseHandle(mapping);
+    return NULL;
+  }
+  return new MappedFile{data, static_cast<size_t>(size.QuadPart), 0, mapping};
+}
+
+static int MappedFileClose(void *handle){
+  auto file = static_cast<MappedFile *>(handle);
+  UnmapViewOfFile(file->data);
+  CloseHandle(file->mapping);
+  delete file;
+  return FLUID_OK;
+}
+#else /* Linux */
+static void *MappedFileOpen(const char *filename){
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0)
+    return NULL;
+  struct stat st;
+  void *data = MAP_FAILED;
+  if(!fstat(fd, &st) && (st.st_size > 0))
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // mapping keeps it
+  if(data == MAP_FAILED)
+    return NULL;
+  madvise(data, st.st_size, MADV_SEQUENTIAL); // FluidSynth reads it in one pass
+  return new MappedFile{static_cast<const char *>(data), static_cast<size_t>(st.st_size), 0};
+}
+
+static int MappedFileClose(void *handle){
+  auto file = static_cast<MappedFile *>(handle);
+  munmap(const_cast<char *>(file->data), file->size);
+  delete file;
+  return FLUID_OK;
+}
+#endif /* platform */
+
+static int MappedFileRead(void *buf, fluid_long_long_t count, void *handle){
+  auto file = static_cast<MappedFile *>(handle);
+  if((count < 0) || (static_cast<size_t>(count) > file->size - file->pos))
+    return FLUID_FAILED;
+  memcpy(buf, file->data + file->pos, count);
+  file->pos += count;
+  return FLUID_OK;
+}
+
+static int MappedFileSeek(void *handle, fluid_long_long_t offset, int origin){
+  auto file = static_cast<MappedFile *>(handle);
+  fluid_long_long_t pos;
+  switch(origin){
+    case SEEK_SET:
+      pos = offset;
+      break;
+    case SEEK_CUR:
+      pos = file->pos + offset;
+      break;
+    case SEEK_END:
+      pos = file->size + offset;
+      break;
+    default:
+      return FLUID_FAILED;
+  }
+  if((pos < 0) || (static_cast<size_t>(pos) > file->size))
+    return FLUID_FAILED;
+  file->pos = pos;
+  return FLUID_OK;
+}
+
+static fluid_long_long_t MappedFileTell(void *handle){
+  return static_cast<MappedFile *>(handle)->pos;
+}
+
+// Private synth for shared sfont, when mapping fails the default loader (stdio) is used
+static fluid_synth_t *NewSharedSynth(){
+  fluid_synth_t *synth = new_fluid_synth(gCacheSettings);
+  if(synth && GetOptions().mmapFiles){
+    fluid_sfloader_t *loader = new_fluid_defsfloader(gCacheSettings);
+    if(loader){
+      fluid_sfloader_set_callbacks(loader, MappedFileOpen, MappedFileRead, MappedFileSeek, MappedFileTell, MappedFileClose);
+      fluid_synth_add_sfloader(synth, loader);
+    }
+  }
+  return synth;
+}
+
+// Can be called with the cache locked, the synth does not call back
+static void ReleaseSharedSoundFont(SharedSoundFont *shared){
+  if(shared->synth){
+    if(shared->sfont){
+      // in case some voice (of other synth) still use samples, FluidSynth will delete
+      // the sfont later. That does not need its synth
+      fluid_synth_sfunload(shared->synth, fluid_sfont_get_id(shared->sfont), 0);
+    }
+    delete_fluid_synth(shared->synth);
+  }
+  gCache.remove_if([shared](const SharedSoundFont& entry){ return &entry == shared; });
+}
+
+
+// Proxy preset
+
+static SharedPreset *ProxyPresetShared(fluid_preset_t *preset){
+  return static_cast<SharedPreset *>(fluid_preset_get_data(preset));
+}
+
+static const char *ProxyPresetGetName(fluid_preset_t *preset){
+  return fluid_preset_get_name(ProxyPresetShared(preset)->preset);
+}
+
+static int ProxyPresetGetBank(fluid_preset_t *preset){
+  return fluid_preset_get_banknum(ProxyPresetShared(preset)->preset);
+}
+
+static int ProxyPresetGetNum(fluid_preset_t *preset){
+  return fluid_preset_get_num(ProxyPresetShared(preset)->preset);
+}
+
+static int ProxyPresetNoteOn(fluid_preset_t *preset, fluid_synth_t *synth, int chan, int key, int vel){
+  SharedPreset *sharedPreset = ProxyPresetShared(preset);
+  if(!sharedPreset->loaded.load(std::memory_order_acquire))
+    return FLUID_OK; // on demand loading, not yet
+  // voices are allocated in the calling synth, the sfont just provides samples and zones
+  return FluidPresetNoteOn(sharedPreset->preset, synth, chan, key, vel);
+}
+
+// On program change, from the audio thread of the synth
+static int ProxyPresetNotify(fluid_preset_t *preset, int reason, int chan){
+  SharedPreset *sharedPreset = ProxyPresetShared(preset);
+  if(reason == FLUID_PRESET_SELECTED){
+    if((sharedPreset->channels++ == 0) && (!sharedPreset->loaded || sharedPreset->streamed)){
+      gPresetsWanted = true;
+      WakeSoundFontLoader();
+    }
+  } else if(reason == FLUID_PRESET_UNSELECTED)
+    --sharedPreset->channels;
+  return FLUID_OK;
+}
+
+static void ProxyPresetFree(fluid_preset_t *preset){
+  // presets are deleted with the proxy sfont
+}
+
+
+// Proxy sfont
+
+static const char *ProxySFontGetName(fluid_sfont_t *sfont){
+  auto proxy = static_cast<SoundFontProxy *>(fluid_sfont_get_data(sfont));
+  return proxy->shared->path.c_str();
+}
+
+static bool PresetLess(fluid_preset_t *preset, int bank, int prog){
+  int presetBank = fluid_preset_get_banknum(preset);
+  return (presetBank < bank) || ((presetBank == bank) && (fluid_preset_get_num(preset) < prog));
+}
+
+static fluid_preset_t *ProxySFontGetPreset(fluid_sfont_t *sfont, int bank, int prog){
+  auto proxy = static_cast<SoundFontProxy *>(fluid_sfont_get_data(sfont));
+  auto it = std::lower_bound(proxy->presets.begin(), proxy->presets.end(), std::make_pair(bank, prog),
+			     [](fluid_preset_t *preset, const std::pair<int, int>& key){ return PresetLess(preset, key.first, key.second); });
+  if((it == proxy->presets.end()) || (fluid_preset_get_banknum(*it) != bank) || (fluid_preset_get_num(*it) != prog))
+    return NULL;
+  return *it;
+}
+
+static void ProxySFontIterationStart(fluid_sfont_t *sfont){
+  static_cast<SoundFontProxy *>(fluid_sfont_get_data(sfont))->iteration = 0;
+}
+
+static fluid_preset_t *ProxySFontIterationNext(fluid_sfont_t *sfont){
+  auto proxy = static_cast<SoundFontProxy *>(fluid_sfont_get_data(sfont));
+  if(proxy->iteration >= proxy->presets.size())
+    return NULL;
+  return proxy->presets[proxy->iteration++];
+}
+
+// Called by the synth when it does not use the sfont anymore
+static int ProxySFontFree(fluid_sfont_t *sfont){
+  auto proxy = static_cast<SoundFontProxy *>(fluid_sfont_get_data(sfont));
+  {
+    std::lock_guard<std::mutex> lock(gCacheMutex);
+    SharedSoundFont *shared = proxy->shared;
+    if(--shared->users == 0)
+      ReleaseSharedSoundFont(shared);
+  }
+  for(auto preset : proxy->presets)
+    delete_fluid_preset(preset);
+  delete proxy;
+  delete_fluid_sfont(sfont);
+  return FLUID_OK;
+}
+
+static fluid_sfont_t *NewProxySFont(SharedSoundFont *shared){
+  fluid_sfont_t *sfont = new_fluid_sfont(ProxySFontGetName, ProxySFontGetPreset,
+					 ProxySFontIterationStart, ProxySFontIterationNext, ProxySFontFree);
+  if(!sfont)
+    return NULL;
+  auto proxy = new SoundFontProxy();
+  proxy->shared = shared;
+  proxy->iteration = 0;
+  for(auto& sharedPreset : shared->presets){
+    fluid_preset_t *preset = new_fluid_preset(sfont, ProxyPresetGetName, ProxyPresetGetBank, ProxyPresetGetNum,
+					      ProxyPresetNoteOn, ProxyPresetFree);
+    if(preset){
+      fluid_preset_set_data(preset, sharedPreset.get());
+      if(!sharedPreset->loaded || sharedPreset->streamed)
+	FluidPresetSetNotify(preset, ProxyPresetNotify);
+      proxy->presets.push_back(preset);
+    }
+  }
+  std::sort(proxy->presets.begin(), proxy->presets.end(), [](fluid_preset_t *a, fluid_preset_t *b){
+      return PresetLess(a, fluid_preset_get_banknum(b), fluid_preset_get_num(b));
+    });
+  fluid_sfont_set_data(sfont, proxy);
+  return sfont;
+}
+
+
+// Loader
+
+/*
+ * SF3 is loaded from decoded copy when there is one (see sf3cache.h), otherwise the
+ * copy is written after loading. info is for the file really loaded, decoded is true
+ * when that is the copy.
+ */
+static fluid_sfont_t *LoadSharedSoundFont(fluid_synth_t *synth, const char *filename, Sf2Info& info, bool& decoded){
+  std::string decodedPath;
+  bool isSf3 = ReadSf2Info(filename, info) && (info.version == 3) &&
+    FluidPrivCompatible() && DecodedSoundFontPath(filename, decodedPath);
+  if(isSf3){
+    Sf2Info decodedInfo;
+    if(ReadSf2Info(decodedPath.c_str(), decodedInfo) && (decodedInfo.version == 2)){
+      int id = fluid_synth_sfload(synth, decodedPath.c_str(), 0);
+      if(id != FLUID_FAILED){
+	info = decodedInfo;
+	decoded = true;
+	return fluid_synth_get_sfont_by_id(synth, id);
+      }
+    }
+  }
+  int id = fluid_synth_sfload(synth, filename, 0);
+  if(id == FLUID_FAILED)
+    return NULL;
+  fluid_sfont_t *sfont = fluid_synth_get_sfont_by_id(synth, id);
+  // with on demand loading and streaming samples are not decoded yet
+  if(isSf3 && !DynamicSamples() && !WriteDecodedSoundFont(filename, decodedPath, sfont))
+    printf("Could not write decoded copy of '%s'\n", filename);
+  return sfont;
+}
+
+static fluid_sfont_t *SharedLoaderLoad(fluid_sfloader_t *loader, const char *filename){
+  struct stat st;
+  if(stat(filename, &st))
+    return NULL;
+  std::unique_lock<std::mutex> lock(gCacheMutex);
+  if(!gCacheSettings){
+    gCacheSettings = new_fluid_settings();
+    // private synths never play
+    fluid_settings_setint(gCacheSettings, "synth.polyphony", 1);
+    fluid_settings_setint(gCacheSettings, "synth.reverb.active", 0);
+    fluid_settings_setint(gCacheSettings, "synth.chorus.active", 0);
+    // with the budget, we lock used presets only (see PrefetchSharedPreset)
+    if(GetOptions().lockMb > 0)
+      fluid_settings_setint(gCacheSettings, "synth.lock-memory", 0);
+    if(DynamicSamples())
+      fluid_settings_setint(gCacheSettings, "synth.dynamic-sample-loading", 1);
+  }
+  auto it = std::find_if(gCache.begin(), gCache.end(), [&](const SharedSoundFont& entry){
+      return (entry.path == filename) && (entry.mtime == st.st_mtime) && (entry.size == st.st_size) &&
+	(entry.loading || entry.sfont);
+    });
+  SharedSoundFont *shared;
+  if(it == gCache.end()){
+    gCache.push_back(SharedSoundFont{filename, st.st_mtime, st.st_size, NULL, NULL, true, 1, Sf2Info(), {}, {}, false});
+    shared = &gCache.back();
+    // do not block other instances while parsing
+    lock.unlock();
+    fluid_synth_t *synth = NewSharedSynth();
+    fluid_sfont_t *sfont = NULL;
+    Sf2Info info;
+    bool decoded = false;
+    if(synth)
+      sfont = LoadSharedSoundFont(synth, filename, info, decoded);
+    bool dynamicSamples = DynamicSamples();
+    // fonts which can not be streamed are loaded on demand
+    bool streamed = sfont && GetOptions().stream && dynamicSamples && StreamSoundFont(sfont, info, decoded);
+    std::vector<std::unique_ptr<SharedPreset>> presets;
+    if(sfont){
+      fluid_sfont_iteration_start(sfont);
+      while(fluid_preset_t *preset = fluid_sfont_iteration_next(sfont))
+	presets.emplace_back(new SharedPreset{preset, {0}, {!dynamicSamples || streamed}, Clock::time_point::max(),
+					      streamed, Clock::time_point()});
+    }
+    lock.lock();
+    shared->presets = std::move(presets);
+    shared->streamed = streamed;
+    shared->info = info;
+    shared->synth = synth;
+    shared->sfont = sfont;
+    shared->loading = false;
+    gCacheLoaded.notify_all();
+  } else {
+    shared = &*it;
+    ++shared->users;
+    gCacheLoaded.wait(lock, [shared]{ return !shared->loading; });
+  }
+  fluid_sfont_t *sfont = shared->sfont ? NewProxySFont(shared) : NULL;
+  if(!sfont && (--shared->users == 0))
+    ReleaseSharedSoundFont(shared);
+  return sfont;
+}
+
+static void SharedLoaderFree(fluid_sfloader_t *loader){
+  delete_fluid_sfloader(loader);
+}
+
+fluid_sfloader_t* NewSharedSoundFontLoader(){
+  // proxy presets call the preset of the shared font through the mirrored private layout
+  if(!FluidPrivCompatible())
+    return NULL;
+  return new_fluid_sfloader(SharedLoaderLoad, SharedLoaderFree);
+}
+
+int SharedSoundFontCount(){
+  std::lock_guard<std::mutex> lock(gCacheMutex);
+  return gCache.size();
+}
+
+
+// Prefetch
+
+static const size_t kPageSize = 4096;
+
+#ifdef WIN32
+static bool LockPages(const char *p, size_t size){
+  return VirtualLock(const_cast<char *>(p), size) != 0;
+}
+
+static void UnlockPages(const char *p, size_t size){
+  VirtualUnlock(const_cast<char *>(p), size);
+}
+#else /* Linux */
+static bool LockPages(const char *p, size_t size){
+  return mlock(p, size) == 0;
+}
+
+static void UnlockPages(const char *p, size_t size){
+  munlock(p, size);
+}
+#endif /* platform */
+
+// The latest loaded, old versions of the file can still be in use
+static SharedSoundFont *FindSharedSoundFont(const char *path){
+  auto it = std::find_if(gCache.rbegin(), gCache.rend(), [path](const SharedSoundFont& entry){
+      return (entry.path == path) && entry.sfont;
+    });
+  return (it == gCache.rend()) ? NULL : &*it;
+}
+
+// Calls op(p, size) for page aligned blocks of preset samples, 16 and 24bit parts
+template<class Op>
+static size_t ForPresetPages(SharedSoundFont *shared, int bank, int program, Op op){
+  const FluidDefSFontPriv *defsfont = FluidDefSFont(shared->sfont);
+  const Sf2PresetSamples *preset = FindPresetSamples(shared->info, bank, program);
+  if(!preset || !FluidPrivCompatible() || !defsfont || !defsfont->sampledata || (shared->info.version != 2))
+    return 0;
+  size_t total = 0;
+  auto block = [&op, &total](const char *data, size_t dataSize, size_t start, size_t end){
+    end = std::min(end, dataSize);
+    if(start >= end)
+      return;
+    const char *first = data + start - (reinterpret_cast<uintptr_t>(data + start) % kPageSize);
+    op(first, data + end - first);
+    total += end - start;
+  };
+  for(auto const& range : preset->ranges){
+    block(reinterpret_cast<const char *>(defsfont->sampledata), defsfont->samplesize, range.first * 2, range.second * 2);
+    if(defsfont->sample24data)
+      block(defsfont->sample24data, defsfont->sample24size, range.first, range.second);
+  }
+  return total;
+}
+
+size_t PrefetchSharedPreset(const char *path, int bank, int program, size_t budget, bool lock){
+  std::lock_guard<std::mutex> guard(gCacheMutex);
+  SharedSoundFont *shared = FindSharedSoundFont(path);
+  if(!shared)
+    return 0;
+  size_t touched = 0;
+  volatile char sum = 0;
+  size_t size = ForPresetPages(shared, bank, program, [&](const char *p, size_t size){
+      for(size_t offset = 0; (offset < size) && (touched < budget); offset += kPageSize, touched += kPageSize)
+	sum += p[offset];
+    });
+  (void)sum;
+  if(lock && size){
+    int key = bank * 128 + program;
+    if(shared->locks[key]++ == 0){
+      ForPresetPages(shared, bank, program, [](const char *p, size_t size){
+	  if(!LockPages(p, size))
+	    printf("Could not lock %d KB of samples in memory\n", (int)(size / 1024));
+	});
+    }
+  }
+  return size;
+}
+
+void UnlockSharedPreset(const char *path, int bank, int program){
+  std::lock_guard<std::mutex> guard(gCacheMutex);
+  SharedSoundFont *shared = FindSharedSoundFont(path);
+  int key = bank * 128 + program;
+  if(!shared || !shared->locks.count(key) || (--shared->locks[key] > 0))
+    return;
+  shared->locks.erase(key);
+  ForPresetPages(shared, bank, program, UnlockPages);
+  // presets can share samples, so lock what is still used again
+  for(auto const& locked : shared->locks)
+    ForPresetPages(shared, locked.first / 128, locked.first % 128, LockPages);
+  if(shared->streamed)
+    LockSampleHeads(shared->sfont);
+}
+
+
+
+// Streaming
+
+/*
+ * Streamed fonts and their mappings. Not under the cache mutex, FluidSynth deletes
+ * the font (StreamSFontFree) from sfunload, which is called with the cache locked.
+ */
+struct StreamedSoundFont {
+  fluid_sfont_t     *sfont;
+  fluid_sfont_free_t free;     // the default loader one
+  MappedFile        *file;
+};
+
+static std::mutex                     gStreamsMutex;
+static std::vector<StreamedSoundFont> gStreams;
+
+#ifdef WIN32
+// PrefetchVirtualMemory is not available before Windows 8, touch
+static void ReadAhead(const char *p, size_t size){
+  volatile char sum = 0;
+  for(size_t offset = 0; offset < size; offset += kPageSize)
+    sum += p[offset];
+  (void)sum;
+}
+
+static void StreamAdvise(MappedFile *file){
+}
+
+long long ThreadMajorFaults(){
+  return 0; // Windows counts soft and hard faults together, per process only
+}
+#else /* Linux */
+static void ReadAhead(const char *p, size_t size){
+  madvise(const_cast<char *>(p), size, MADV_WILLNEED); // asynchronous
+}
+
+// Mapped for loading as sequential, but samples are read many times
+static void StreamAdvise(MappedFile *file){
+  madvise(const_cast<char *>(file->data), file->size, MADV_NORMAL);
+}
+
+long long ThreadMajorFaults(){
+  struct rusage usage;
+  if(getrusage(RUSAGE_THREAD, &usage))
+    return 0;
+  return usage.ru_majflt;
+}
+#endif /* platform */
+
+static bool IsLittleEndian(){
+  const unsigned short one = 1;
+  return *reinterpret_cast<const unsigned char *>(&one) == 1;
+}
+
+// Lock (or at least touch, when the system does not allow) the first "streamhead" ms of each sample
+static void LockSampleHeads(fluid_sfont_t *sfont){
+  const FluidDefSFontPriv *defsfont = FluidDefSFont(sfont);
+  size_t total = 0;
+  bool locked = true;
+  auto head = [&total, &locked](const char *data, size_t start, size_t size){
+    const char *first = data + start - (reinterpret_cast<uintptr_t>(data + start) % kPageSize);
+    size += data + start - first;
+    if(!locked || !LockPages(first, size)){
+      locked = false;
+      ReadAhead(first, size);
+    }
+    total += size;
+  };
+  for(FluidListPriv *list = defsfont->sample; list; list = list->next){
+    const FluidSamplePriv *sample = static_cast<const FluidSamplePriv *>(list->data);
+    if(sample->end < sample->start)
+      continue;
+    size_t points = std::min<size_t>(sample->end - sample->start + 1,
+				     static_cast<size_t>(sample->samplerate) * GetOptions().streamHeadMs / 1000);
+    if(!points)
+      continue;
+    head(reinterpret_cast<const char *>(defsfont->sampledata), sample->start * 2, points * 2);
+    if(defsfont->sample24data)
+      head(defsfont->sample24data, sample->start, points);
+  }
+  if(!locked)
+    printf("Could not lock %d KB of sample heads in memory\n", (int)(total / 1024));
+}
+
+// Called by FluidSynth, it tries again later when that fails
+static int StreamSFontFree(fluid_sfont_t *sfont){
+  std::lock_guard<std::mutex> lock(gStreamsMutex);
+  auto it = std::find_if(gStreams.begin(), gStreams.end(), [sfont](const StreamedSoundFont& stream){
+      return stream.sfont == sfont;
+    });
+  if(it == gStreams.end())
+    return FLUID_FAILED; // can not happen
+  const FluidDefSFontPriv *defsfont = FluidDefSFont(sfont);
+  for(FluidListPriv *list = defsfont->sample; list; list = list->next){
+    if(static_cast<const FluidSamplePriv *>(list->data)->refcount)
+      return FLUID_FAILED; // some voice still plays it
+  }
+  // the default loader frees loaded samples only
+  FluidDefSFontSetSampleData(sfont, NULL, NULL);
+  int result = it->free(sfont);
+  MappedFileClose(it->file);
+  gStreams.erase(it);
+  return result;
+}
+
+static bool CopyFilePart(FILE *from, size_t pos, size_t size, FILE *to){
+  std::vector<char> buf(std::min<size_t>(size, kStreamCopyBufSize));
+  if(fseek(from, pos, SEEK_SET))
+    return false;
+  while(size > 0){
+    size_t n = std::min(size, buf.size());
+    if((fread(buf.data(), 1, n, from) != n) || (fwrite(buf.data(), 1, n, to) != n))
+      return false;
+    size -= n;
+  }
+  return true;
+}
+
+// Mapped copy of the expected size, NULL when there is no such
+static MappedFile *MapCopy(const std::string& path, size_t size){
+  auto file = static_cast<MappedFile *>(MappedFileOpen(path.c_str()));
+  if(file && (file->size != size)){
+    MappedFileClose(file);
+    file = NULL;
+  }
+  return file;
+}
+
+/*
+ * Copy of the sample chunks (16bit, then optional 24bit part) in the cache directory.
+ * Voices read streamed samples in process, so the user file is never mapped for that: when it
+ * is truncated or rewritten (fonts are edited, see the font watcher) mapped access crashes.
+ * The copy is keyed as decoded SF3 copies and published by rename only, so it is never changed
+ * under a mapping. It is reused by the next loads (also by other processes), till the font changes.
+ */
+static MappedFile *MapSampleCopy(const FluidDefSFontPriv *defsfont){
+  std::string path, tmpPath;
+  if(!StreamCopyPath(defsfont->filename, path, tmpPath))
+    return NULL;
+  size_t size = (size_t)defsfont->samplesize + defsfont->sample24size;
+  if(MappedFile *file = MapCopy(path, size))
+    return file;
+  FILE *from = fopen(defsfont->filename, "rb");
+  if(!from)
+    return NULL;
+  FILE *to = fopen(tmpPath.c_str(), "wb");
+  if(!to){
+    fclose(from);
+    return NULL;
+  }
+  bool ok = CopyFilePart(from, defsfont->samplepos, defsfont->samplesize, to) &&
+    (!defsfont->sample24size || CopyFilePart(from, defsfont->sample24pos, defsfont->sample24size, to));
+  fclose(from);
+  ok = !fclose(to) && ok;
+  if(!ok || !CommitStreamCopy(defsfont->filename, tmpPath, path)){
+    remove(tmpPath.c_str());
+    return NULL;
+  }
+  //printf("Copied samples of '%s' into '%s'\n", defsfont->filename, path.c_str());
+  return MapCopy(path, size);
+}
+
+/*
+ * The font is loaded with dynamic sample loading and no preset was selected, so no samples are
+ * loaded. Samples are little endian 16bit in the file and FluidSynth uses them as they are
+ * (with the optional 24bit part), so on little endian systems the file can be played directly.
+ * Decoded SF3 copies are written by us only (replaced by rename), so they are mapped as they
+ * are, other fonts are streamed from a private copy.
+ */
+static bool StreamSoundFont(fluid_sfont_t *sfont, const Sf2Info& info, bool decoded){
+  const FluidDefSFontPriv *defsfont = FluidDefSFont(sfont);
+  if(!IsLittleEndian() || (info.version != 2) || !defsfont || defsfont->sampledata || !defsfont->samplesize ||
+     (defsfont->samplepos % 2))
+    return false;
+  const char *sampleData, *sample24Data = NULL;
+  MappedFile *file;
+  if(decoded){
+    file = static_cast<MappedFile *>(MappedFileOpen(defsfont->filename));
+    if(!file)
+      return false;
+    if((defsfont->samplepos + (size_t)defsfont->samplesize > file->size) ||
+       (defsfont->sample24size && (defsfont->sample24pos + (size_t)defsfont->sample24size > file->size))){
+      MappedFileClose(file);
+      return false;
+    }
+    sampleData = file->data + defsfont->samplepos;
+    if(defsfont->sample24size)
+      sample24Data = file->data + defsfont->sample24pos;
+  } else {
+    if(!(file = MapSampleCopy(defsfont)))
+      return false;
+    sampleData = file->data;
+    if(defsfont->sample24size)
+      sample24Data = file->data + defsfont->samplesize;
+  }
+  StreamAdvise(file);
+  FluidDefSFontSetSampleData(sfont, reinterpret_cast<short *>(const_cast<char *>(sampleData)), const_cast<char *>(sample24Data));
+  LockSampleHeads(sfont);
+  std::lock_guard<std::mutex> lock(gStreamsMutex);
+  gStreams.push_back(StreamedSoundFont{sfont, FluidSFontSetFree(sfont, StreamSFontFree), file});
+  return true;
+}
+
+
+
+// On demand loading
+
+static long long NowMs(){
+  return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+}
+
+bool HasSharedPresetWork(){
+  return DynamicSamples() && !gPresetsServing &&
+    (gPresetsWanted || (NowMs() - gPresetsChecked >= kEvictCheckMs));
+}
+
+/*
+ * Samples are unloaded only after loaded was false for kEvictGraceMs, so no new voice
+ * use them. Fonts with work are kept (as users) while serving without the cache lock.
+ */
+void ServeSharedPresets(){
+  if(gPresetsServing.exchange(true))
+    return;
+  gPresetsWanted = false;
+  gPresetsChecked = NowMs();
+  Clock::time_point now = Clock::now();
+  std::vector<SharedSoundFont *> fonts;
+  std::vector<SharedPreset *> toLoad, toEvict;
+  std::vector<std::pair<SharedSoundFont *, SharedPreset *>> toReadAhead;
+  {
+    std::lock_guard<std::mutex> lock(gCacheMutex);
+    for(auto& shared : gCache){
+      if(!shared.sfont)
+	continue;
+      std::chrono::duration<double> window(std::max<double>(GetOptions().evictSec, shared.info.maxReleaseSec + 1.));
+      size_t work = toLoad.size() + toEvict.size() + toReadAhead.size();
+      for(auto& sharedPreset : shared.presets){
+	if(sharedPreset->channels > 0){
+	  sharedPreset->unusedSince = Clock::time_point::max();
+	  if(!sharedPreset->loaded)
+	    toLoad.push_back(sharedPreset.get());
+	  else if(sharedPreset->streamed && (now - sharedPreset->readAhead >= std::chrono::milliseconds(kStreamReadAheadMs))){
+	    sharedPreset->readAhead = now;
+	    toReadAhead.emplace_back(&shared, sharedPreset.get());
+	  }
+	} else if(sharedPreset->streamed){
+	  sharedPreset->readAhead = Clock::time_point(); // at once when selected again
+	} else if(sharedPreset->loaded){
+	  if(sharedPreset->unusedSince == Clock::time_point::max())
+	    sharedPreset->unusedSince = now;
+	  else if(now - sharedPreset->unusedSince > window)
+	    toEvict.push_back(sharedPreset.get());
+	}
+      }
+      if(toLoad.size() + toEvict.size() + toReadAhead.size() > work){
+	++shared.users;
+	fonts.push_back(&shared);
+      }
+    }
+  }
+  for(auto sharedPreset : toLoad){
+    FluidPresetNotify(sharedPreset->preset, FLUID_PRESET_SELECTED, 0);
+    sharedPreset->loaded.store(true, std::memory_order_release);
+  }
+  if(!toEvict.empty()){
+    for(auto sharedPreset : toEvict)
+      sharedPreset->loaded = false;
+    std::this_thread::sleep_for(std::chrono::milliseconds(kEvictGraceMs));
+    for(auto sharedPreset : toEvict){
+      if(sharedPreset->channels > 0){ // selected again meanwhile
+	sharedPreset->loaded = true;
+	continue;
+      }
+      FluidPresetNotify(sharedPreset->preset, FLUID_PRESET_UNSELECTED, 0);
+      sharedPreset->unusedSince = Clock::time_point::max();
+    }
+  }
+  for(auto const& readAhead : toReadAhead){
+    fluid_preset_t *preset = readAhead.second->preset;
+    ForPresetPages(readAhead.first, fluid_preset_get_banknum(preset), fluid_preset_get_num(preset), ReadAhead);
+  }
+  if(GetOptions().telemetry && (toLoad.size() || toEvict.size() || toReadAhead.size()))
+    printf("Presets samples: %d loaded, %d unloaded, %d read ahead\n", (int)toLoad.size(), (int)toEvict.size(), (int)toReadAhead.size());
+  {
+    std::lock_guard<std::mutex> lock(gCacheMutex);
+    for(auto shared : fonts){
+      if(--shared->users == 0)
+	ReleaseSharedSoundFont(shared);
+    }
+  }
+  gPresetsServing = false;
+}
+
+bool SharedPresetsLoading(){
+  std::lock_guard<std::mutex> lock(gCacheMutex);
+  for(auto const& shared : gCache){
+    for(auto const& sharedPreset : shared.presets){
+      if((sharedPreset->channels > 0) && !sharedPreset->loaded)
+	return true;
+    }
+  }
+  return false;
+}
+
+}
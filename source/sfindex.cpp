@@ -0,0 +1,333 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else /* Linux */
+#include <dirent.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif /* platform */
+
+#include "../include/fluidsynthvst.h"
+#include "../include/options.h"
+#include "../include/sfindex.h"
+
+namespace FluidSynthVST {
+
+using Clock = std::chrono::steady_clock;
+
+struct IndexDir {
+  std::string        path;
+  int                watch;    // inotify watch descriptor, -1 when not watched
+  Clock::time_point  scanned;
+};
+
+struct IndexEntry {
+  size_t             dir;      // the first directory with the name
+  bool               hasInfo;
+  SoundFontFileInfo  info;
+};
+
+static std::mutex                         gIndexMutex;
+static std::vector<IndexDir>              gIndexDirs;
+static std::map<std::string, IndexEntry>  gIndex; // sorted by name
+static uint32                             gIndexGeneration = 0;
+static bool                               gIndexInitialized = false;
+#ifndef WIN32
+static int                                gIndexNotify = -1;
+#endif
+
+static bool IsSoundFontName(const char *name){
+  size_t len = strlen(name);
+  // used pattern is ".sf?", f.e. name.sf2 and name.sf3
+  return (len > 4) && !memcmp(name + len - 4, ".sf", 3);
+}
+
+static std::string JoinPath(const std::string& dir, const char *name){
+#ifdef WIN32
+  return dir + "\\" + name;
+#else /* Linux */
+  return dir + "/" + name;
+#endif /* platform */
+}
+
+static bool StatFile(const std::string& path, long long& size, long long& mtime){
+#ifdef WIN32
+  WCHAR wszPath[MAX_PATH];
+  WIN32_FILE_ATTRIBUTE_DATA data;
+  if(!MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, wszPath, MAX_PATH) ||
+     !GetFileAttributesExW(wszPath, GetFileExInfoStandard, &data))
+    return false;
+  size = ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+  mtime = ((long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+#else /* Linux */
+  struct stat st;
+  if(stat(path.c_str(), &st))
+    return false;
+  size = st.st_size;
+  mtime = st.st_mtime;
+#endif /* platform */
+  return true;
+}
+
+// File names of the directory, without any other information (that is slow on network shares)
+static void ReadDirectory(const std::string& dir, std::vector<std::string>& names){
+#ifdef WIN32
+  WCHAR szPattern[MAX_PATH];
+  if(!MultiByteToWideChar(CP_UTF8, 0, JoinPath(dir, "*.sf?").c_str(), -1, szPattern, MAX_PATH))
+    return;
+  HANDLE hFind;
+  WIN32_FIND_DATAW FindData;
+  if((hFind = FindFirstFileW(szPattern, &FindData)) != INVALID_HANDLE_VALUE){
+    do {
+      char name[MAX_PATH * 3];
+      if(WideCharToMultiByte(CP_UTF8, 0, FindData.cFileName, -1, name, sizeof(name), NULL, NULL) > 0){
+	// used pattern is translated using DOS wildcards, f.e. it will match name.sfpack
+	if(IsSoundFontName(name))
+	  names.push_back(name);
+      }
+    } while(FindNextFileW(hFind, &FindData));
+    FindClose(hFind);
+  }
+#else /* Linux */
+  DIR *d = opendir(dir.c_str());
+  if(d){
+    struct dirent *de;
+    while((de = readdir(d))){
+      if(IsSoundFontName(de->d_name))
+	names.push_back(de->d_name); // will be in file system encoding, hope it is UTF8
+    }
+    closedir(d);
+  }
+#endif /* platform */
+}
+
+// Add the name found in the directory, returns true when the list is changed
+static bool AddEntry(size_t dir, const std::string& name){
+  auto it = gIndex.find(name);
+  if(it == gIndex.end()){
+    gIndex[name] = IndexEntry{dir, false, SoundFontFileInfo()};
+    return true;
+  }
+  if(it->second.dir > dir){ // the same name in preferred directory
+    it->second.dir = dir;
+    it->second.hasInfo = false;
+  }
+  return false;
+}
+
+// Remove the name not found in the directory (anymore), returns true when the list is changed
+static bool RemoveEntry(size_t dir, const std::string& name){
+  auto it = gIndex.find(name);
+  if((it == gIndex.end()) || (it->second.dir != dir))
+    return false;
+  // can still be in some other directory
+  for(size_t other = dir + 1; other < gIndexDirs.size(); ++other){
+    long long size, mtime;
+    if(StatFile(JoinPath(gIndexDirs[other].path, name.c_str()), size, mtime)){
+      it->second.dir = other;
+      it->second.hasInfo = false;
+      return false;
+    }
+  }
+  gIndex.erase(it);
+  return true;
+}
+
+static bool ScanDirectory(size_t dir){
+  std::vector<std::string> names;
+  ReadDirectory(gIndexDirs[dir].path, names);
+  gIndexDirs[dir].scanned = Clock::now();
+  std::sort(names.begin(), names.end());
+  bool changed = false;
+  for(auto const& name : names)
+    changed = AddEntry(dir, name) || changed;
+  std::vector<std::string> removed;
+  for(auto const& entry : gIndex){
+    if((entry.second.dir == dir) && !std::binary_search(names.begin(), names.end(), entry.first))
+      removed.push_back(entry.first);
+  }
+  for(auto const& name : removed)
+    changed = RemoveEntry(dir, name) || changed;
+  return changed;
+}
+
+static void InitIndex(){
+  char szPath[FILENAME_MAX];
+  GetPath(szPath, FILENAME_MAX);
+  gIndexDirs.push_back(IndexDir{szPath, -1, Clock::time_point()});
+  for(auto const& dir : GetOptions().libraryDirs)
+    gIndexDirs.push_back(IndexDir{dir, -1, Clock::time_point()});
+#ifndef WIN32
+  gIndexNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  for(auto& dir : gIndexDirs){
+    if(gIndexNotify >= 0)
+      dir.watch = inotify_add_watch(gIndexNotify, dir.path.c_str(),
+				    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+    if(dir.watch < 0)
+      printf("SoundFont directory '%s' is not watched, will be scanned periodically\n", dir.path.c_str());
+  }
+#endif /* platform */
+  for(size_t dir = 0; dir < gIndexDirs.size(); ++dir)
+    ScanDirectory(dir);
+  gIndexInitialized = true;
+}
+
+#ifndef WIN32
+// Apply pending inotify events, returns true when the list is changed
+static bool ReadNotifications(){
+  bool changed = false;
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+  while((len = read(gIndexNotify, buf, sizeof(buf))) > 0){
+    for(char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len){
+      const struct inotify_event *event = (const struct inotify_event *)p;
+      if(event->mask & IN_Q_OVERFLOW){
+	// lost events, scan everything
+	for(size_t dir = 0; dir < gIndexDirs.size(); ++dir)
+	  changed = ScanDirectory(dir) || changed;
+	continue;
+      }
+      auto dirIt = std::find_if(gIndexDirs.begin(), gIndexDirs.end(), [event](const IndexDir& dir){
+	  return dir.watch == event->wd;
+	});
+      if(dirIt == gIndexDirs.end())
+	continue;
+      size_t dir = dirIt - gIndexDirs.begin();
+      if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)){
+	// directory itself has gone, continue with rescans
+	dirIt->watch = -1;
+	changed = ScanDirectory(dir) || changed;
+	continue;
+      }
+      if(!event->len || !IsSoundFontName(event->name))
+	continue;
+      std::string name(event->name);
+      if(event->mask & (IN_CREATE | IN_MOVED_TO))
+	changed = AddEntry(dir, name) || changed;
+      else if(event->mask & (IN_DELETE | IN_MOVED_FROM))
+	changed = RemoveEntry(dir, name) || changed;
+      else if(event->mask & IN_CLOSE_WRITE){
+	auto it = gIndex.find(name);
+	if((it != gIndex.end()) && (it->second.dir == dir))
+	  it->second.hasInfo = false;
+      }
+    }
+  }
+  return changed;
+}
+#endif /* platform */
+
+// Should be called with locked mutex
+static void RefreshIndex(){
+  if(!gIndexInitialized){
+    InitIndex();
+    ++gIndexGeneration;
+    return;
+  }
+  bool changed = false;
+#ifndef WIN32
+  if(gIndexNotify >= 0)
+    changed = ReadNotifications();
+#endif /* platform */
+  Clock::time_point now = Clock::now();
+  int32 rescanSec = GetOptions().rescanSec;
+  for(size_t dir = 0; dir < gIndexDirs.size(); ++dir){
+    int32 period = (gIndexDirs[dir].watch >= 0) ? rescanSec : (rescanSec > 0 ? rescanSec : kRescanSec);
+    if((period > 0) && (now - gIndexDirs[dir].scanned >= std::chrono::seconds(period)))
+      changed = ScanDirectory(dir) || changed;
+  }
+  if(changed)
+    ++gIndexGeneration;
+}
+
+uint32 GetSoundFontNames(std::vector<std::string>& names){
+  std::lock_guard<std::mutex> lock(gIndexMutex);
+  RefreshIndex();
+  names.clear();
+  for(auto const& entry : gIndex)
+    names.push_back(entry.first);
+  return gIndexGeneration;
+}
+
+uint32 GetSoundFontIndexGeneration(){
+  std::lock_guard<std::mutex> lock(gIndexMutex);
+  RefreshIndex();
+  return gIndexGeneration;
+}
+
+void GetSoundFontPath(const char *name, char *path, int32 size){
+  std::string fullPath;
+  {
+    std::lock_guard<std::mutex> lock(gIndexMutex);
+    RefreshIndex();
+    auto it = gIndex.find(name);
+    if(it != gIndex.end())
+      fullPath = JoinPath(gIndexDirs[it->second.dir].path, name);
+  }
+  if(fullPath.empty()){
+    GetPath(path, size);
+    PathAppend(path, size, name);
+  } else if(fullPath.size() < (size_t)size)
+    strcpy(path, fullPath.c_str());
+  else
+    *path = 0;
+}
+
+bool GetSoundFontInfo(const char *name, SoundFontFileInfo& info){
+  char path[FILENAME_MAX];
+  GetSoundFontPath(name, path, FILENAME_MAX);
+  if(!StatFile(path, info.size, info.mtime))
+    return false;
+  {
+    std::lock_guard<std::mutex> lock(gIndexMutex);
+    auto it = gIndex.find(name);
+    if((it != gIndex.end()) && it->second.hasInfo &&
+       (it->second.info.size == info.size) && (it->second.info.mtime == info.mtime)){
+      info = it->second.info;
+      return true;
+    }
+  }
+  // parse without the lock, that can take a while on network storage
+  if(!ReadSf2Info(path, info.sf2))
+    return false;
+  std::lock_guard<std::mutex> lock(gIndexMutex);
+  auto it = gIndex.find(name);
+  if(it != gIndex.end()){
+    it->second.info = info;
+    it->second.hasInfo = true;
+  }
+  return true;
+}
+
+}
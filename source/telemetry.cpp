@@ -0,0 +1,142 @@
+/*
+ * FluidSynth VST
+ *
+ * Wrapper part (this file): Copyright (C) 2019 AZ (www.azslow.com)
+ *
+ * FluidSynth: Copyright (C) 2003-2019  Peter Hanappe and others.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../include/telemetry.h"
+#include "../include/options.h"
+
+namespace FluidSynthVST {
+
+using Clock = std::chrono::steady_clock;
+
+static const int32 kDrainPeriodMs = 100;
+static const int32 kStatisticsPeriodSec = 10;
+
+static std::mutex               gTelemetryMutex;
+static std::condition_variable  gTelemetryCondition; // stop
+static std::vector<Telemetry *> gTelemetries;
+static std::thread              gTelemetryThread;
+static bool                     gTelemetryStop = false;
+
+static void TelemetryThread(){
+  std::unique_lock<std::mutex> lock(gTelemetryMutex);
+  while(!gTelemetryStop){
+    for(auto telemetry : gTelemetries)
+      telemetry->drain();
+    gTelemetryCondition.wait_for(lock, std::chrono::milliseconds(kDrainPeriodMs));
+  }
+}
+
+Telemetry::Telemetry() : mOverflows(0), mBlocks(0), mBlockUs(0), mMaxBlockUs(0), mMaxVoices(0), mLastDropped(0), mLastPrint(Clock::now()) {
+  mTimed = GetOptions().telemetry;
+  for(auto& bin : mHistogram)
+    bin = 0;
+  std::lock_guard<std::mutex> lock(gTelemetryMutex);
+  gTelemetries.push_back(this);
+  if(!gTelemetryThread.joinable() && !gTelemetryStop)
+    gTelemetryThread = std::thread(TelemetryThread);
+}
+
+Telemetry::~Telemetry(){
+  {
+    // after that the thread does not touch us
+    std::lock_guard<std::mutex> lock(gTelemetryMutex);
+    gTelemetries.erase(std::find(gTelemetries.begin(), gTelemetries.end(), this));
+  }
+  drain(); // the producer is gone
+  if(mTimed){
+    printf("FluidSynthVST %p block time histogram (uSec: count):\n", (void *)this);
+    for(int32 i = 0; i < kHistogramBins; ++i){
+      if(mHistogram[i])
+	printf("  %s%u: %llu\n", (i == kHistogramBins - 1) ? ">= " : "< ", 1u << ((i == kHistogramBins - 1) ? i - 1 : i),
+	       (unsigned long long)mHistogram[i]);
+    }
+  }
+}
+
+void Telemetry::drain(){
+  TelemetryRecord record;
+  while(mRing.pop(record)){
+    switch(record.type){
+      case kTelBlock: {
+	++mBlocks;
+	mBlockUs += record.duration;
+	mMaxBlockUs = std::max(mMaxBlockUs, record.duration);
+	mMaxVoices = std::max(mMaxVoices, record.arg[2]);
+	mLastDropped = record.arg[3];
+	int32 bin = 0;
+	while((bin < kHistogramBins - 1) && (record.duration >= (1 << bin)))
+	  ++bin;
+	++mHistogram[bin];
+	break;
+      }
+      case kTelProbe:
+	printf("Probe %d: %d uSec\n", record.id, record.duration);
+	break;
+      case kTelUnknownEvent:
+	printf("Unprocessed Event type: %d\n", record.arg[0]);
+	break;
+      case kTelUnknownParam:
+	printf("Unknown param change ID: %d\n", record.arg[0]);
+	break;
+      case kTelUnknownCtrl:
+	printf("Hmm... unknown control %d (Ch:%d)\n", record.arg[1], record.arg[0] + 1);
+	break;
+      case kTelQualityTier:
+	printf("Quality tier: %d\n", record.arg[0]);
+	break;
+      case kTelUnderrun:
+	printf("Stream underrun: %d page faults (%d underruns)\n", record.arg[0], record.arg[1]);
+	break;
+    }
+  }
+  if(mTimed && (Clock::now() - mLastPrint >= std::chrono::seconds(kStatisticsPeriodSec)))
+    printStatistics();
+}
+
+void Telemetry::printStatistics(){
+  mLastPrint = Clock::now();
+  if(!mBlocks)
+    return;
+  printf("FluidSynthVST %p: %llu blocks, avg %lld uSec, max %d uSec, max voices %d, dropped items %d, lost records %u\n",
+	 (void *)this, (unsigned long long)mBlocks, (long long)(mBlockUs / (int64)mBlocks), mMaxBlockUs, mMaxVoices,
+	 mLastDropped, mOverflows.load());
+  mBlocks = 0;
+  mBlockUs = 0;
+  mMaxBlockUs = 0;
+  mMaxVoices = 0;
+}
+
+void StopTelemetry(){
+  {
+    std::lock_guard<std::mutex> lock(gTelemetryMutex);
+    gTelemetryStop = true;
+    gTelemetryCondition.notify_all();
+  }
+  if(gTelemetryThread.joinable())
+    gTelemetryThread.join();
+}
+
+}